@@ -22,11 +22,38 @@
 
 // Prototype for the alarm callback function.
 typedef void(*callback_func_t)(void* data);
+
+// Callback lanes of a thread, expired high priority alarms are called
+// before any normal one waiting on the same thread.
+typedef enum {
+	ALARM_PRIORITY_NORMAL = 0,
+	ALARM_PRIORITY_HIGH,
+	ALARM_PRIORITY_MAX
+}alarm_priority_t;
+
+class Alarm;
+
 typedef struct {
+	Alarm *alarm;
+	Thread *thread;
+	FixedQueue *queues[ALARM_PRIORITY_MAX];
+	reactor_object_t *objects[ALARM_PRIORITY_MAX];
+}alarm_lanes_t;
+
+
+#define ALARM_HISTOGRAM_BUCKETS 24
+
+// Log2 histogram of times in us: bucket 0 counts 0, bucket i counts
+// [2^(i-1), 2^i) and the last one everything above.
+typedef struct alarm_histogram_t {
 	size_t count;
-	uint64_t total_ms;
-	uint64_t max_ms;
-}stat_t;
+	uint64_t total_us;
+	uint64_t max_us;
+	size_t buckets[ALARM_HISTOGRAM_BUCKETS];
+
+	void Record(uint64_t us);
+	uint64_t Percentile(int percent) const;
+}alarm_histogram_t;
 
 typedef struct {
 	const char *name;
@@ -35,55 +62,221 @@ typedef struct {
 	size_t rescheduled_count;
 	size_t total_updates;
 	uint64_t last_update_ms;
-	stat_t overdue_scheduling;
-	stat_t premature_scheduling;
+	alarm_histogram_t overdue_scheduling;	//callback start after the deadline
+	alarm_histogram_t premature_scheduling;	//callback start before the deadline
+	size_t wakeups_saved;	//expiries served by a wakeup armed for another alarm
+	size_t missed_periods;	//periods skipped because the alarm fired too late
 }alarm_stats_t;
 
-typedef struct {
+typedef struct alarm_data_t {
 	bool isPeriodic;
 	uint64_t creation_time;
 	uint64_t period;
 	uint64_t deadline;
 	uint64_t prev_deadline;
-	FixedQueue *queue;
-	std::recursive_mutex *callback_mutex;
+	uint64_t slack;		//how late the alarm may fire to share a wakeup, 0 for exact
+	uint64_t latest;	//deadline + slack
+	size_t heap_index;	//slot in the deadline heap, ALARM_NOT_SCHEDULED when idle
+	size_t latest_index;	//slot in the latest heap
+	FixedQueue *queue;	//lane the callback is queued on once expired
+	bool queued;		//on |queue| waiting for its callback, at most once
+	std::atomic<int> callback_state;	//tid running the callback plus ALARM_CALLBACK_* flags, 0 when idle
 	callback_func_t callback_func;
 	void *data;
 	alarm_stats_t stats;
+	struct alarm_data_t *prev;	//links of the owner's list of live timers
+	struct alarm_data_t *next;
 }alarm_data_t;
 
+#define ALARM_NOT_SCHEDULED ((size_t)-1)
+
+// Flags of alarm_data_t::callback_state, above any tid.
+#define ALARM_CALLBACK_WAITERS		(1 << 30)	//a canceler sleeps until the callback returns
+#define ALARM_CALLBACK_FREE_PENDING	(1 << 29)	//freed by its own callback, recycled once it returns
+#define ALARM_CALLBACK_TID_MASK		(ALARM_CALLBACK_FREE_PENDING - 1)
+
+/**
+ * \brief Storage for the alarms of every Alarm and HighResAlarm
+ *
+ * Alarms are carved from chunks of kChunk and kept on a free list, and
+ * names are interned, so once the slab has grown to the working set,
+ * creating and freeing a timer never touches the allocator. Slots are
+ * never returned to the system.
+ */
+class AlarmSlab {
+public:
+	static AlarmSlab& GetInstance();
+
+	alarm_data_t* Acquire(const char* name, bool is_periodic);
+	void Recycle(alarm_data_t *alarm);
+protected:
+	AlarmSlab();
+	~AlarmSlab();
+
+	const char* Intern(const char* name);
+	void Grow();
+private:
+	static const size_t kChunk = 64;
+	union slot_t {
+		slot_t *next;
+		std::aligned_storage<sizeof(alarm_data_t), alignof(alarm_data_t)>::type storage;
+	};
+	std::mutex m_mutex;
+	slot_t *m_free;
+	std::vector<slot_t*> m_chunks;
+	std::set<std::string, std::less<> > m_names;	//every name ever used, never shrinks
+};
+
+/**
+ * \brief Binary min-heap of alarms on one of their times
+ *
+ * Every alarm keeps its slot in the heap in |index|, so any alarm can be
+ * removed in O(log n).
+ */
+class AlarmHeap {
+public:
+	AlarmHeap(uint64_t alarm_data_t::*key, size_t alarm_data_t::*index)
+		:m_key(key)
+		,m_index(index) {}
+	~AlarmHeap() {}
+
+	bool IsEmpty() { return m_items.empty(); }
+	size_t GetSize() { return m_items.size(); }
+	alarm_data_t* At(size_t index) { return m_items[index]; }
+	alarm_data_t* Top() { return m_items.empty() ? NULL : m_items[0]; }
+	bool Contains(alarm_data_t *alarm) { return alarm->*m_index != ALARM_NOT_SCHEDULED; }
+	void Push(alarm_data_t *alarm);
+	void Remove(alarm_data_t *alarm);
+	uint64_t MaxKeyUpTo(uint64_t limit);
+protected:
+	void SiftUp(size_t index);
+	void SiftDown(size_t index);
+	void Place(size_t index, alarm_data_t *alarm);
+private:
+	std::vector<alarm_data_t*> m_items;
+	std::vector<size_t> m_pending;	//scratch of MaxKeyUpTo(), kept to not allocate
+	uint64_t alarm_data_t::*m_key;
+	size_t alarm_data_t::*m_index;
+};
+
+/**
+ * \brief Schedules one-shot and periodic alarms
+ *
+ * Pending alarms sit in two min-heaps, one on the deadline and one on the
+ * latest time they may fire (deadline + slack). Scheduling and canceling
+ * are O(log n). Every alarm due by the earliest latest time has to fire in
+ * the next wakeup, so the kernel timer is armed for the last deadline among
+ * them: alarms with overlapping slack windows share one wakeup, and an
+ * alarm with nobody to share with still fires on its deadline. The kernel
+ * timer is only re-armed when that time changes. That time is kept up to
+ * date as alarms come and go; the heap is only walked again when the alarm
+ * with the earliest latest time, or the one it was armed for, leaves.
+ *
+ * The timers are timerfds watched by the dispatcher thread's reactor, which
+ * hands expired alarms straight to their callback queue. Every thread that
+ * runs callbacks has its own pair of queues on its reactor, one per
+ * priority, so alarms of different modules don't wait on each other.
+ * Alarms set without a thread run on the default callback thread.
+ */
 class Alarm {
 public:
 	Alarm();
 	~Alarm();	
 
 	alarm_data_t* CreateTimer(const char* name, bool is_periodic);
-	void SetTimer(alarm_data_t *timer, uint64_t interval, callback_func_t cb, void *data);
+	void FreeTimer(alarm_data_t *timer);
+	void SetTimer(alarm_data_t *timer, uint64_t interval, callback_func_t cb, void *data,
+		uint64_t slack = 0, Thread *thread = NULL,
+		alarm_priority_t priority = ALARM_PRIORITY_NORMAL);
+	void ReleaseThread(Thread *thread);
+	void CancelTimer(alarm_data_t *timer);
+	bool IsScheduled(alarm_data_t *timer);
+	uint64_t GetRemainingMs(alarm_data_t *timer);
+	void Dump(int fd);
 protected:	
 
 	bool lazy_initialize(void);
-	bool create_timer(const clockid_t clock_id, timer_t* timer);
+	bool create_timer(const clockid_t clock_id, int* fd);
 	void schedule_next_instance(alarm_data_t *alarm);
+	void cancel_internal(alarm_data_t *alarm);
+	void reschedule_root_alarm(void);
+	void unschedule(alarm_data_t *alarm);
+	void batch_add(alarm_data_t *alarm);
+	void batch_remove(alarm_data_t *alarm);
+	void dispatch_expired(void);
+	alarm_lanes_t* get_lanes(Thread *thread);
+	alarm_lanes_t* new_lanes(Thread *thread);
+	void free_lanes(alarm_lanes_t *lanes);
 
 	static uint64_t now(void);
-	static void timer_callback(void *arg);
+	static void timer_ready(void* context);
 	static void alarm_queue_ready(void* context);
-	static void callback_dispatch(void* context, void* arg);
 
 private:	
-	alarm_data_t m_alarm;
-	
 	std::mutex m_mutex;
-	SeqList *m_alarmList;
-	timer_t m_timer;
-	timer_t m_wakeuptimer;
-	EventLock *m_alarmExpired;
-	Thread *m_callbackThread;
-	FixedQueue *m_callbackQueue;
-	bool m_dispatchThreadActive;
+	alarm_data_t *m_timers;	//every timer created and not freed yet, linked through prev/next
+	size_t m_timerCount;
+	AlarmHeap m_deadlines;	//pending alarms by deadline
+	AlarmHeap m_latest;	//pending alarms by deadline + slack
+	uint64_t m_armedDeadline;	//time the kernel timer is set to, 0 when disarmed
+	uint64_t m_batchLimit;	//earliest deadline + slack when the batch was computed
+	uint64_t m_batchDeadline;	//latest deadline up to |m_batchLimit|, the next wakeup
+	bool m_batchStale;	//the batch has to be computed again from the heaps
+	int m_timerfd;
+	int m_wakeupfd;	//CLOCK_BOOTTIME_ALARM, INVALID_FD if the kernel has none
+	reactor_object_t *m_timerObject;
+	reactor_object_t *m_wakeupObject;
+	Thread *m_callbackThread;	//runs the callbacks of alarms set without a thread
+	std::vector<alarm_lanes_t*> m_lanes;	//one per callback thread, default first
 	Thread *m_dispatchThread;
 	
 };
 
-#endif //_UTIL_ALARM_H_
+/**
+ * \brief Nanosecond alarms for media scheduling
+ *
+ * Same alarms as Alarm, but all times are in ns of CLOCK_MONOTONIC, and the
+ * callbacks run straight on the alarm's own RT thread, there is no hop to a
+ * callback queue. Periodic deadlines advance by whole periods from the first
+ * one, never from the time the callback ran, so they don't drift however
+ * many periods pass. Periods that were missed altogether are skipped and
+ * counted.
+ *
+ * With |spin_ns| set, the timer is armed that much ahead of the deadline and
+ * the rest is busy-waited, which trades CPU time for wakeup latency.
+ * Callbacks must be short, they delay every other alarm of the instance.
+ * How late they start is recorded in the overdue_scheduling histogram.
+ */
+class HighResAlarm {
+public:
+	HighResAlarm(const char* name = "alarm_highres", uint64_t spin_ns = 0);
+	~HighResAlarm();
 
+	alarm_data_t* CreateTimer(const char* name, bool is_periodic);
+	void FreeTimer(alarm_data_t *timer);
+	void SetTimer(alarm_data_t *timer, uint64_t interval_ns, callback_func_t cb, void *data);
+	void SetTimerAt(alarm_data_t *timer, uint64_t deadline_ns, uint64_t period_ns,
+		callback_func_t cb, void *data);
+	void CancelTimer(alarm_data_t *timer);
+	bool IsScheduled(alarm_data_t *timer);
+	void Dump(int fd);
+
+	static uint64_t Now(void);
+protected:
+	void arm(void);
+	void dispatch_expired(void);
+
+	static void timer_ready(void* context);
+private:
+	std::mutex m_mutex;
+	alarm_data_t *m_timers;
+	size_t m_timerCount;
+	AlarmHeap m_deadlines;
+	uint64_t m_armedTime;	//time the timerfd is set to, 0 when disarmed
+	uint64_t m_spinNs;
+	int m_timerfd;
+	reactor_object_t *m_timerObject;
+	Thread *m_thread;
+};
+
+#endif //_UTIL_ALARM_H_
@@ -19,7 +19,10 @@
 *********************************************************************************/
 #ifndef _UTILS_CONCURRENCY_H_
 #define _UTILS_CONCURRENCY_H_
+#include <atomic>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
 
 class Mutex
 {
@@ -44,6 +47,7 @@ public:
 	~Condition();
 
 	void wait();
+	bool wait_for(uint64_t timeout_ms);
 	void signal();
 	void broadcast();
 
@@ -59,6 +63,7 @@ public:
 	~ConCurrency();
 
 	void wait();
+	bool wait_for(uint64_t timeout_ms);
 	void signal();
 	void broadcast();
 
@@ -69,4 +74,62 @@ private:
 };
 
 
+/**
+ * \brief Counting semaphore on a futex
+ *
+ * signal() and an uncontended wait() are a single atomic operation, the
+ * kernel is only entered when a waiter really has to sleep. wait() spins
+ * adaptively before it sleeps. The whole state is one futex word, so the
+ * semaphore may be destroyed as soon as a waiter returns.
+ */
+class Semaphore
+{
+public:
+	explicit Semaphore(int count = 0);
+	~Semaphore() {}
+
+	void wait();
+	bool wait_for(uint64_t timeout_ms);
+	bool try_wait();
+	void signal();
+
+protected:
+	bool acquire(const struct timespec *deadline);
+	bool spin();
+
+private:
+	std::atomic<int> m_value;	//available count, -1 for none with sleepers
+	std::atomic<int> m_spin;	//recent useful spin length
+};
+
+/**
+ * \brief Manual reset event on a futex
+ *
+ * set() is a single atomic operation and only enters the kernel when
+ * somebody sleeps in wait().
+ */
+class EventFlag
+{
+public:
+	explicit EventFlag(bool set = false);
+	~EventFlag() {}
+
+	void set();
+	void reset();
+	bool is_set() { return m_state.load(std::memory_order_acquire) == 1; }
+	void wait();
+	bool wait_for(uint64_t timeout_ms);
+
+protected:
+	bool wait_until(const struct timespec *deadline);
+
+private:
+	std::atomic<int> m_state;	//0 clear, 1 set, 2 clear with sleepers
+};
+
+// Thin wrappers over the private futex syscall; |deadline| is absolute on
+// CLOCK_MONOTONIC, NULL waits forever.
+int futex_wait(std::atomic<int> *addr, int expected, const struct timespec *deadline);
+int futex_wake(std::atomic<int> *addr, int count);
+
 #endif //_UTILS_CONCURRENCY_H_
@@ -0,0 +1,280 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+#ifndef _UTILS_COROUTINE_H_
+#define _UTILS_COROUTINE_H_
+
+#if defined(__cpp_impl_coroutine)
+#include <stddef.h>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+
+#include "thread.h"
+#include "future.h"
+
+/**
+ * \brief Recycles coroutine frames by size class
+ *
+ * Frames up to kMaxFrame bytes are rounded up to a power of two and kept
+ * on a free list per class when the coroutine ends, so a procedure that
+ * runs again, or one of the same shape, never touches the allocator.
+ * Larger frames go straight to the heap.
+ */
+class CoFramePool {
+public:
+	static CoFramePool& GetInstance() {
+		static CoFramePool s_pool;
+		return s_pool;
+	}
+
+	void* Allocate(size_t size) {
+		size_t index = class_of(size);
+		if (index == kClasses) return ::operator new(size);
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			slot_t *slot = m_free[index];
+			if (slot != nullptr) {
+				m_free[index] = slot->next;
+				return slot;
+			}
+		}
+		return ::operator new(kMinFrame << index);
+	}
+	void Free(void *frame, size_t size) {
+		size_t index = class_of(size);
+		if (index == kClasses) {
+			::operator delete(frame);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		slot_t *slot = static_cast<slot_t*>(frame);
+		slot->next = m_free[index];
+		m_free[index] = slot;
+	}
+
+protected:
+	CoFramePool() {
+		for (size_t i = 0; i < kClasses; ++i)
+			m_free[i] = nullptr;
+	}
+	~CoFramePool() {
+		for (size_t i = 0; i < kClasses; ++i) {
+			while (m_free[i] != nullptr) {
+				slot_t *next = m_free[i]->next;
+				::operator delete(m_free[i]);
+				m_free[i] = next;
+			}
+		}
+	}
+
+	static size_t class_of(size_t size) {
+		size_t index = 0;
+		while (index < kClasses && (kMinFrame << index) < size)
+			++index;
+		return index;
+	}
+
+private:
+	static const size_t kMinFrame = 64;
+	static const size_t kClasses = 7;	//64 bytes to kMaxFrame
+	static const size_t kMaxFrame = kMinFrame << (kClasses - 1);
+	struct slot_t {
+		slot_t *next;
+	};
+	std::mutex m_mutex;
+	slot_t *m_free[kClasses];
+};
+
+/**
+ * \brief Coroutine running on stack threads
+ *
+ *   CoTask controller_init(Thread *hci) {
+ *       co_await SwitchTo(hci);
+ *       void *ok = co_await AwaitFuture(send_reset(), hci);
+ *       co_await DelayOn(hci, 10);
+ *       co_return ok;
+ *   }
+ *
+ * The body runs on the caller until its first co_await, and after each
+ * one on the Thread the awaitable names, resumed from that thread's
+ * reactor, so no thread ever blocks for it. Every body must end with
+ * co_return; the value readies the task's Future, which callers can
+ * Await() or chain with Then(). The frame comes from CoFramePool and
+ * holds the Future too; it is released once the body has returned and
+ * the CoTask is gone, whichever comes last.
+ */
+class CoTask {
+public:
+	struct promise_type;
+
+private:
+	// Ends the body, which frees the frame, unless the CoTask still needs
+	// its Future; then the frame waits, suspended, for ~CoTask().
+	struct FinalSuspend {
+		bool await_ready() noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+			return !handle.promise().release();
+		}
+		void await_resume() noexcept {}
+	};
+
+public:
+	struct promise_type {
+		promise_type()
+			: m_future()
+			, m_refs(2) {}
+
+		CoTask get_return_object() {
+			return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		FinalSuspend final_suspend() noexcept { return {}; }
+		void return_value(void *value) { m_future.Ready(value); }
+		void unhandled_exception() { std::terminate(); }
+
+		// Drops one of the two holders of the frame, true for the last one.
+		bool release() { return m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
+		static void* operator new(size_t size) {
+			return CoFramePool::GetInstance().Allocate(size);
+		}
+		static void operator delete(void *frame, size_t size) {
+			CoFramePool::GetInstance().Free(frame, size);
+		}
+
+		Future m_future;
+		std::atomic<int> m_refs;	//the running body and the CoTask
+	};
+
+	CoTask(CoTask&& other)
+		: m_handle(other.m_handle) {
+		other.m_handle = nullptr;
+	}
+	CoTask(const CoTask&) = delete;
+	CoTask& operator=(const CoTask&) = delete;
+	~CoTask() {
+		if (m_handle && m_handle.promise().release())
+			m_handle.destroy();
+	}
+
+	Future* GetFuture() { return &m_handle.promise().m_future; }
+
+private:
+	explicit CoTask(std::coroutine_handle<promise_type> handle)
+		: m_handle(handle) {}
+
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+/**
+ * \brief co_await on a Future: resumes on |thread| with its result, or
+ * inline on the thread that made it ready when |thread| is NULL
+ */
+class AwaitFuture {
+public:
+	AwaitFuture(Future *future, Thread *thread = NULL)
+		: m_future(future)
+		, m_thread(thread)
+		, m_result(NULL) {}
+
+	bool await_ready() {
+		// A ready future still hops when the coroutine is on another thread.
+		if (!m_future->IsReady()) return false;
+		if (m_thread != NULL && !m_thread->IsSelf()) return false;
+		m_result = m_future->GetResult();
+		return true;
+	}
+	void await_suspend(std::coroutine_handle<> handle) {
+		m_handle = handle;
+		// The coroutine may be running again on |m_thread| before Then()
+		// returns, nothing here may be touched after it. The continuation
+		// lives in the awaiter, in the frame, so nothing is allocated.
+		m_future->Then(&m_continuation, m_thread, resume, this);
+	}
+	void* await_resume() { return m_result; }
+
+private:
+	static void resume(void *context, void *result) {
+		AwaitFuture *thiz = static_cast<AwaitFuture*>(context);
+		thiz->m_result = result;
+		thiz->m_handle.resume();
+	}
+
+	Future *m_future;
+	Thread *m_thread;
+	void *m_result;
+	std::coroutine_handle<> m_handle;
+	Future::continuation_t m_continuation;
+};
+
+/**
+ * \brief co_await on a delay: resumes on |thread| after |delay_ms|
+ */
+class DelayOn {
+public:
+	DelayOn(Thread *thread, uint64_t delay_ms)
+		: m_thread(thread)
+		, m_delay(delay_ms) {}
+
+	bool await_ready() { return false; }
+	void await_suspend(std::coroutine_handle<> handle) {
+		m_thread->PostDelayed(resume, handle.address(), NULL, m_delay);
+	}
+	void await_resume() {}
+
+private:
+	static void resume(void *context, void *arg) {
+		(void)arg;
+		std::coroutine_handle<>::from_address(context).resume();
+	}
+
+	Thread *m_thread;
+	uint64_t m_delay;
+};
+
+/**
+ * \brief co_await to hop: resumes on |thread| through its work queue
+ */
+class SwitchTo {
+public:
+	explicit SwitchTo(Thread *thread)
+		: m_thread(thread) {}
+
+	bool await_ready() { return false; }
+	void await_suspend(std::coroutine_handle<> handle) {
+		m_thread->Post(resume, handle.address());
+	}
+	void await_resume() {}
+
+private:
+	static void resume(void *context, void *arg) {
+		(void)arg;
+		std::coroutine_handle<>::from_address(context).resume();
+	}
+
+	Thread *m_thread;
+};
+
+#endif //__cpp_impl_coroutine
+
+#endif //_UTILS_COROUTINE_H_
@@ -19,17 +19,24 @@
 *********************************************************************************/ 
 #ifndef _UTILS_EVENTBUS_H_
 #define _UTILS_EVENTBUS_H_
-#include <map>
-#include <list>
-#include <queue>
-#include <vector>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
-#include <typeindex>
-#include <typeinfo>
+#include <new>
+#include <time.h>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "concurrency.h"
+#include "thread.h"
 #include "threadpool.h"
 
+class EventPoolBase;
+
 /**
  * \brief The base event class, all events inherit from this class
  */
@@ -42,21 +49,137 @@ public:
 	};
 	Event(void *sender, int id, ThreadMode mode)
 		: m_id(id)
+		, m_mode(mode)
 		, m_sender(sender)
-		, m_mode(mode) {}
-	~Event() {}
+		, m_refs(1)
+		, m_pool(nullptr) {}
+	virtual ~Event() {}
 	
 	void *getSender() { return m_sender; }
 	int getId() { return m_id; }
-	Worker *getWorker() { return m_worker; }
-	void setWorker(Worker *worker) { m_worker = worker; }
 	ThreadMode getThreadMode() { return m_mode; }
 protected:
+	friend class EventBus;
+	template<typename T> friend class EventPool;
 private:	
 	int m_id;
 	ThreadMode m_mode;
 	void* const m_sender;
-	Worker *m_worker;
+	std::atomic<int> m_refs;	//deliveries still pending, recycled at zero
+	EventPoolBase *m_pool;	//pool the event is recycled to, null for heap events
+};
+
+// Occupancy of an event pool, in events.
+typedef struct {
+	size_t capacity;	//slots owned by the pool
+	size_t in_use;		//events currently published and not yet recycled
+	size_t peak;		//highest in_use seen
+	size_t grows;		//times the pool had to allocate more slots
+}event_pool_stats_t;
+
+// Time spent in one listener's onEvent(), over all its deliveries.
+typedef struct {
+	size_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+}listener_stats_t;
+
+// Queue of one BACKGROUND event type, see EventBus::setQueuePolicy().
+typedef struct {
+	size_t queued;		//events waiting for delivery
+	size_t peak;		//highest queued seen
+	size_t dropped;		//events discarded by the overflow policy
+	size_t coalesced;	//events replaced in the queue by a newer one with the same key
+}event_queue_stats_t;
+
+class EventPoolBase {
+public:
+	virtual ~EventPoolBase() {}
+	virtual void recycle(Event *event) = 0;
+};
+
+/**
+ * \brief Per-type storage for events published with EventBus::publish()
+ *
+ * Slots are carved from chunks of kChunk events and kept on a free list,
+ * so once the pool has grown to the working set, publishing an event never
+ * touches the allocator. Slots are never returned to the system.
+ */
+template<typename T>
+class EventPool : public EventPoolBase {
+public:
+	static EventPool& getInstance() {
+		static EventPool s_pool;
+		return s_pool;
+	}
+
+	template<typename... Args>
+	T* create(Args&&... args) {
+		T *event = new (acquire()) T(std::forward<Args>(args)...);
+		event->m_pool = this;
+		return event;
+	}
+	virtual void recycle(Event *event) {
+		T *object = static_cast<T*>(event);
+		object->~T();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		slot_t *slot = reinterpret_cast<slot_t*>(object);
+		slot->next = m_free;
+		m_free = slot;
+		m_stats.in_use--;
+	}
+	void reserve(size_t count) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		while (m_stats.capacity < count)
+			grow();
+	}
+	event_pool_stats_t getStats() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_stats;
+	}
+
+protected:
+	EventPool()
+		: m_free(nullptr)
+		, m_stats() {}
+	~EventPool() {
+		for (slot_t *chunk : m_chunks)
+			delete[] chunk;
+	}
+
+	void* acquire() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_free == nullptr)
+			grow();
+
+		slot_t *slot = m_free;
+		m_free = slot->next;
+		if (++m_stats.in_use > m_stats.peak)
+			m_stats.peak = m_stats.in_use;
+		return slot;
+	}
+	void grow() {
+		slot_t *chunk = new slot_t[kChunk];
+		m_chunks.push_back(chunk);
+		for (size_t i = 0; i < kChunk; ++i) {
+			chunk[i].next = m_free;
+			m_free = &chunk[i];
+		}
+		m_stats.capacity += kChunk;
+		m_stats.grows++;
+	}
+
+private:
+	static const size_t kChunk = 64;
+	union slot_t {
+		slot_t *next;
+		typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+	};
+	std::mutex m_mutex;
+	slot_t *m_free;
+	std::vector<slot_t*> m_chunks;
+	event_pool_stats_t m_stats;
 };
 
 template<typename T>
@@ -66,7 +189,7 @@ public:
 		// An error here indicates you're trying to implement IEventListener with a type that is not derived from Event
 		static_assert(std::is_base_of<Event, T>::value, "IEventListener<T>: T must be a class derived from Event");
 	}
-	~IEventListener() {
+	virtual ~IEventListener() {
 	}
 
 	/**
@@ -77,153 +200,556 @@ public:
 	virtual void onEvent(T& event) = 0;
 };
 
+/**
+ * \brief Dispatches events to the listeners registered for their type
+ *
+ * Every event type gets a dense id the first time it is used. Handlers sit
+ * in a flat table indexed by that id. The table is copied on write and
+ * published as an immutable snapshot, so dispatching takes no lock and
+ * publishers never serialize against each other. A listener may still see
+ * an event that was already being delivered when it was removed.
+ *
+ * MAIN and DEFAULT events are delivered on the publisher's thread.
+ * BACKGROUND events are queued and delivered in order by one pool task.
+ * A listener registered with a Thread is always called on that thread:
+ * its events go to a per-thread mailbox, and all the events that pile up
+ * before the thread gets to it are delivered by a single Thread::Post(),
+ * so the listener's state needs no lock. Such a Thread must keep running
+ * for as long as the bus exists.
+ * An event type can be switched to parallel fan-out, see setParallel(),
+ * and its background queue can be bounded, see setQueuePolicy().
+ * The bus owns dispatched events and deletes them after delivery; events
+ * built by publish() come from a per-type EventPool and are recycled to it.
+ */
 class EventBus {
 public:
+	enum OverflowPolicy {
+		DROP_OLDEST,
+		DROP_NEWEST
+	};
+
 	EventBus()
-		:m_processing(false)
-		, m_mutex()
-		, m_threadpool(3)
+		:m_table(std::make_shared<HandlerTable_t>())
+		, m_processing(false)
+		, m_drain(this)
+		, m_threadpool()
 	{
 	}
 	~EventBus() {}
 
 	template<typename T>
-	void addListener(IEventListener<T>* listener) {
-		HandlerList_t* handlers = m_handlers[typeid(T)];
+	void addListener(IEventListener<T>* listener, Thread* thread = nullptr) {
+		size_t type = typeId<T>();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stats.emplace_back(new ListenerStats());
+		handler_t handler = { static_cast<void*>(listener), &EventBus::invoke<T>,
+			thread != nullptr ? getMailbox(thread) : nullptr, m_stats.back().get() };
+		std::shared_ptr<HandlerTable_t> table = copyTable(type);
+		(*table)[type].handlers.push_back(handler);
+		std::atomic_store(&m_table, std::shared_ptr<const HandlerTable_t>(table));
+	}
+	template<typename T>
+	void removeListener(IEventListener<T>* listener) {
+		size_t type = typeId<T>();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::shared_ptr<const HandlerTable_t> current = std::atomic_load(&m_table);
+		if (current->size() <= type)
+			return;
 
-		// Create a new collection instance for this type if it hasn't been created yet
-		if (handlers == nullptr) {
-			handlers = new HandlerList_t();
-			m_handlers[typeid(T)] = handlers;
+		std::shared_ptr<HandlerTable_t> table = copyTable(type);
+		HandlerList_t &handlers = (*table)[type].handlers;
+		for (HandlerList_t::iterator it = handlers.begin(); it != handlers.end(); ++it) {
+			if (it->listener == static_cast<void*>(listener)) {
+				handlers.erase(it);
+				std::atomic_store(&m_table, std::shared_ptr<const HandlerTable_t>(table));
+				break;
+			}
 		}
+	}
 
-		// Create a new EventPair instance for this registration.
-		EventHandler *handler = new EventHandler(this, static_cast<void*>(listener));
+	/**
+	 * \brief Runs the unbound listeners of T concurrently on the pool
+	 *
+	 * Each listener is a task of its own, the publishing thread runs one
+	 * of them itself. Delivery of a T returns, and the event is recycled,
+	 * only once all of them are done. The listeners must then tolerate
+	 * running at the same time as each other. Listeners bound to a Thread
+	 * are not affected.
+	 */
+	template<typename T>
+	void setParallel(bool parallel) {
+		size_t type = typeId<T>();
 
-		// Add the listener object to the collection
-		handlers->push_back(handler);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::shared_ptr<HandlerTable_t> table = copyTable(type);
+		(*table)[type].parallel = parallel;
+		std::atomic_store(&m_table, std::shared_ptr<const HandlerTable_t>(table));
 	}
 	template<typename T>
-	void removeListener(IEventListener<T>* listener) {
-		HandlerList_t* handlers = m_handlers[typeid(T)];
-		if (handlers != nullptr) {
-			for (auto &handler : *handlers) {
-				if (handler->getListener() == listener) {
-					handlers->remove(handler);
-					delete handler;
-					break;
-				}
-			}
+	bool getListenerStats(IEventListener<T>* listener, listener_stats_t* stats) {
+		size_t type = typeId<T>();
+		std::shared_ptr<const HandlerTable_t> table = std::atomic_load(&m_table);
+		if (stats == nullptr || table->size() <= type)
+			return false;
 
-			if (handlers->empty())
-				delete handlers;
+		for (const handler_t &handler : (*table)[type].handlers) {
+			if (handler.listener == static_cast<void*>(listener)) {
+				handler.stats->get(stats);
+				return true;
+			}
 		}
+		return false;
 	}
 	
-	void dispatchEvent(Event* event) {
-		std::lock_guard<std::mutex> lock(m_mutex);
+	/**
+	 * \brief Constructs a T from |args| in its EventPool and dispatches it
+	 */
+	template<typename T, typename... Args>
+	void publish(Args&&... args) {
+		dispatchEvent(EventPool<T>::getInstance().create(std::forward<Args>(args)...));
+	}
+	template<typename T>
+	static event_pool_stats_t getPoolStats() {
+		return EventPool<T>::getInstance().getStats();
+	}
 
-		//add event to queue
-		m_events.push(event);
+	/**
+	 * \brief Bounds the queue of BACKGROUND events of type T
+	 *
+	 * Once |capacity| events of T wait for delivery (0 for no limit),
+	 * |policy| decides which one is discarded. With |coalesce| only the
+	 * latest event per key stays queued: a newer one takes the place of the
+	 * queued one, so the listeners see the current state at the original
+	 * position. The key is 64 bits wide so a BD_ADDR fits whole, it
+	 * defaults to Event::getId(). MAIN and DEFAULT events are never queued
+	 * and not affected.
+	 */
+	template<typename T>
+	void setQueuePolicy(size_t capacity, OverflowPolicy policy, bool coalesce = false,
+		std::function<uint64_t(T&)> key = nullptr) {
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		EventQueue &queue = getQueue(typeId<T>());
+		queue.capacity = capacity;
+		queue.policy = policy;
+		queue.coalesce = coalesce;
+		if (key)
+			queue.key = [key](Event& event) { return key(static_cast<T&>(event)); };
+		else
+			queue.key = [](Event& event) { return static_cast<uint64_t>(event.getId()); };
+		queue.index();
+	}
+	template<typename T>
+	event_queue_stats_t getQueueStats() {
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		EventQueue &queue = getQueue(typeId<T>());
+		queue.stats.queued = queue.events.size();
+		return queue.stats;
+	}
+
+	template<typename T>
+	void dispatchEvent(T* event) {
+		static_assert(std::is_base_of<Event, T>::value, "dispatchEvent<T>: T must be a class derived from Event");
+		if (event == nullptr) return;
+
+		if (event->getThreadMode() != Event::ThreadMode::BACKGROUND) {
+			deliver(event, typeId<T>());
+			release(event);
+			return;
+		}
+
+		Event *discarded;
+		{
+			std::lock_guard<std::mutex> lock(m_queueMutex);
+
+			//add event to queue, start a drain unless one is running
+			discarded = enqueue(typeId<T>(), event);
+			if (!m_processing && !m_order.empty()) {
+				m_processing = true;
+				m_threadpool.submit(&m_drain);
+			}
+		}
 
-		if (!m_processing)
-			scheduleEvent();		
+		if (discarded != nullptr)
+			release(discarded);
 	}
 
 protected:
-	class EventHandler : public Task {
+	class Mailbox;
+
+	// Parallel listeners delivered to without touching the allocator.
+	static const size_t kInlineTasks = 16;
+
+	class ListenerStats {
 	public:
-		EventHandler(EventBus* bus, void* const listener)
+		ListenerStats()
+			:m_count(0)
+			,m_total(0)
+			,m_max(0) {}
+		void record(uint64_t ns) {
+			m_count.fetch_add(1, std::memory_order_relaxed);
+			m_total.fetch_add(ns, std::memory_order_relaxed);
+			uint64_t max = m_max.load(std::memory_order_relaxed);
+			while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+			}
+		}
+		void get(listener_stats_t* stats) {
+			stats->count = m_count.load(std::memory_order_relaxed);
+			stats->total_us = m_total.load(std::memory_order_relaxed) / 1000;
+			stats->max_us = m_max.load(std::memory_order_relaxed) / 1000;
+		}
+	private:
+		std::atomic<size_t> m_count;
+		std::atomic<uint64_t> m_total;	//ns
+		std::atomic<uint64_t> m_max;	//ns
+	};
+
+	typedef struct {
+		void *listener;
+		void (*invoke)(void *listener, Event &event);
+		Mailbox *mailbox;	//thread the listener is bound to, null for none
+		ListenerStats *stats;
+	}handler_t;
+
+	typedef std::vector<handler_t> HandlerList_t;
+	typedef struct {
+		HandlerList_t handlers;
+		bool parallel;	//fan out to the pool, see setParallel()
+	}type_entry_t;
+	typedef std::vector<type_entry_t> HandlerTable_t;
+
+	/**
+	 * \brief Deliveries waiting for the thread their listeners are bound to
+	 */
+	class Mailbox {
+	public:
+		Mailbox(Thread* thread)
+			:m_thread(thread)
+			,m_posted(false) {}
+		~Mailbox() {}
+
+		void push(Event* event, const handler_t& handler) {
+			delivery_t delivery = { event, handler };
+			bool post;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_pending.push_back(delivery);
+				post = !m_posted;
+				m_posted = true;
+			}
+
+			//one post in flight carries everything queued until it runs
+			if (post)
+				m_thread->Post(&Mailbox::drain, this);
+		}
+		Thread* getThread() { return m_thread; }
+
+	protected:
+		typedef struct {
+			Event *event;
+			handler_t handler;
+		}delivery_t;
+
+		static void drain(void* context, void* /*arg*/) {
+			Mailbox *mailbox = static_cast<Mailbox*>(context);
+			{
+				std::lock_guard<std::mutex> lock(mailbox->m_mutex);
+				mailbox->m_draining.swap(mailbox->m_pending);
+				mailbox->m_posted = false;
+			}
+
+			for (const delivery_t &delivery : mailbox->m_draining) {
+				EventBus::call(delivery.handler, *delivery.event);
+				EventBus::release(delivery.event);
+			}
+			mailbox->m_draining.clear();
+		}
+
+	private:
+		Thread *m_thread;
+		std::mutex m_mutex;
+		std::vector<delivery_t> m_pending;
+		std::vector<delivery_t> m_draining;	//only touched on |m_thread|
+		bool m_posted;
+	};
+
+	/**
+	 * \brief Queued BACKGROUND events of one type and their policy
+	 */
+	class EventQueue {
+	public:
+		EventQueue()
+			:head(0)
+			,capacity(0)
+			,policy(DROP_OLDEST)
+			,coalesce(false)
+			,stats() {}
+
+		// Queued event with the same coalesce key as |event|, or null.
+		Event** find(Event* event) {
+			std::unordered_map<uint64_t, uint64_t>::iterator it = slots.find(key(*event));
+			return it == slots.end() ? nullptr : &events[it->second - head];
+		}
+		void push(Event* event) {
+			if (coalesce)
+				slots[key(*event)] = head + events.size();
+			events.push_back(event);
+		}
+		Event* pop() {
+			Event *event = events.front();
+			events.pop_front();
+			if (coalesce) {
+				std::unordered_map<uint64_t, uint64_t>::iterator it = slots.find(key(*event));
+				if (it != slots.end() && it->second == head)
+					slots.erase(it);
+			}
+			head++;
+			return event;
+		}
+		// Rebuilds |slots| after the policy changed.
+		void index() {
+			slots.clear();
+			if (!coalesce) return;
+			for (size_t i = 0; i < events.size(); ++i)
+				slots[key(*events[i])] = head + i;
+		}
+
+		std::deque<Event*> events;
+		uint64_t head;	//sequence number of events.front()
+		std::unordered_map<uint64_t, uint64_t> slots;	//coalesce key to sequence number of its queued event
+		size_t capacity;	//0 for unbounded
+		OverflowPolicy policy;
+		bool coalesce;
+		std::function<uint64_t(Event&)> key;
+		event_queue_stats_t stats;
+	};
+
+	class DrainTask : public Task {
+	public:
+		DrainTask(EventBus* bus)
 			:Task()
-			,m_bus(bus)
-			,m_listener(listener) {}
-		~EventHandler() {}
+			,m_bus(bus) {}
+		~DrainTask() {}
 		virtual void run() {
-			if (m_bus != nullptr)
-				m_bus->processEvent();
+			m_bus->processEvents();
 		}
-		void* const getListener() { return m_listener; }
-	protected:
 	private:
 		EventBus *m_bus;
-		void* const m_listener;
 	};
-	void scheduleEvent() {
-		std::lock_guard<std::mutex> lock(m_mutex);
-		Event* event = m_events.front();
-		if (event == nullptr) return;
-		switch (event->getThreadMode())	{
-		case Event::ThreadMode::BACKGROUND:
-		{
-			Worker *worker = event->getWorker();
-			if (worker == nullptr) {
-				worker = m_threadpool.peek();
-				if (worker == nullptr) {
-					if (!m_threadpool.push(new Worker()) ||
-						(worker = m_threadpool.peek()) == nullptr) {
-						//maybe thread pool overflow
-						m_threadpool.flush();
-						worker = m_threadpool.peek();
-					}						
-				}
-				event->setWorker(worker);
-				HandlerList_t* handlers = m_handlers[typeid(event)];
-				worker->add_task(event->getId(), handlers->front());
+
+	// Delivers one event to one listener of a parallel fan-out.
+	class ListenerTask : public Task {
+	public:
+		ListenerTask()
+			:Task()
+			,m_handler(nullptr)
+			,m_event(nullptr)
+			,m_latch(nullptr) {}
+		~ListenerTask() {}
+		void set(const handler_t* handler, Event* event, TaskLatch* latch) {
+			m_handler = handler;
+			m_event = event;
+			m_latch = latch;
+		}
+		virtual void run() {
+			call(*m_handler, *m_event);
+			m_latch->done();
+		}
+	private:
+		const handler_t *m_handler;
+		Event *m_event;
+		TaskLatch *m_latch;
+	};
+
+	static size_t nextTypeId() {
+		static std::atomic<size_t> s_next(0);
+		return s_next++;
+	}
+	template<typename T>
+	static size_t typeId() {
+		static const size_t id = nextTypeId();
+		return id;
+	}
+	template<typename T>
+	static void invoke(void *listener, Event &event) {
+		static_cast<IEventListener<T>*>(listener)->onEvent(static_cast<T&>(event));
+	}
+	static uint64_t now_ns() {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+	// Runs one listener and records how long it took. |start| is the time
+	// it starts if the caller has it already, like the end of the previous
+	// listener, 0 otherwise. Returns the time it ended.
+	static uint64_t call(const handler_t& handler, Event& event, uint64_t start = 0) {
+		if (start == 0)
+			start = now_ns();
+		handler.invoke(handler.listener, event);
+		uint64_t end = now_ns();
+		handler.stats->record(end - start);
+		return end;
+	}
+
+	void deliver(Event* event, size_t type) {
+		std::shared_ptr<const HandlerTable_t> table = std::atomic_load(&m_table);
+		if (type >= table->size())
+			return;
+
+		const type_entry_t &entry = (*table)[type];
+		size_t fanout = 0;
+		uint64_t clock = 0;	//end of the listener called last, one clock read per listener
+		for (const handler_t &handler : entry.handlers) {
+			if (handler.mailbox != nullptr) {
+				event->m_refs.fetch_add(1, std::memory_order_relaxed);
+				handler.mailbox->push(event, handler);
+				clock = 0;
+			} else if (entry.parallel) {
+				fanout++;
+			} else {
+				clock = call(handler, *event, clock);
 			}
-			worker->schedule();
 		}
-			break;
-		case Event::ThreadMode::MAIN:
-			processEvent();
-			break;
-		case Event::ThreadMode::DEFAULT:
-			processEvent();
-			break;
+
+		if (fanout > 1) {
+			//one task per listener but the first, which runs right here,
+			//the latch is the barrier. The tasks live on the stack unless
+			//there are more listeners than kInlineTasks.
+			ListenerTask inline_tasks[kInlineTasks];
+			std::unique_ptr<ListenerTask[]> spill;
+			ListenerTask *tasks = inline_tasks;
+			if (fanout - 1 > kInlineTasks) {
+				spill.reset(new ListenerTask[fanout - 1]);
+				tasks = spill.get();
+			}
+
+			TaskLatch latch(fanout - 1);
+			const handler_t *first = nullptr;
+			size_t count = 0;
+			for (const handler_t &handler : entry.handlers) {
+				if (handler.mailbox != nullptr)
+					continue;
+				if (first == nullptr) {
+					first = &handler;
+					continue;
+				}
+				tasks[count].set(&handler, event, &latch);
+				m_threadpool.submit(&tasks[count++]);
+			}
+			call(*first, *event);
+			m_threadpool.wait(latch);
+		} else if (fanout == 1) {
+			for (const handler_t &handler : entry.handlers) {
+				if (handler.mailbox == nullptr)
+					call(handler, *event);
+			}
 		}
 	}
 
-	/**
-	* \brief event handler, run on thread
-	*/
-	void processEvent() {
-		std::lock_guard<std::mutex> lock(m_mutex);
+	// Called with |m_mutex| held, returns a private copy of the current
+	// table that has an entry for |type|.
+	std::shared_ptr<HandlerTable_t> copyTable(size_t type) {
+		std::shared_ptr<HandlerTable_t> table =
+			std::make_shared<HandlerTable_t>(*std::atomic_load(&m_table));
+		if (table->size() <= type)
+			table->resize(type + 1);
+		return table;
+	}
 
-		Event* event = m_events.front();
-		if (event == nullptr)
-			return;
+	// Called with |m_mutex| held, mailboxes live as long as the bus.
+	Mailbox* getMailbox(Thread* thread) {
+		for (const std::unique_ptr<Mailbox> &mailbox : m_mailboxes) {
+			if (mailbox->getThread() == thread)
+				return mailbox.get();
+		}
+		m_mailboxes.emplace_back(new Mailbox(thread));
+		return m_mailboxes.back().get();
+	}
 
-		HandlerList_t* handlers = m_handlers[typeid(event)];
-		// there no listener for this event, do nothing
-		if (handlers == nullptr)
+	static void release(Event* event) {
+		if (event->m_refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
 			return;
 
-		m_processing = true;
-		for (auto &handler : *handlers) {
-			if (handler != nullptr)
-				static_cast<IEventListener<Event>*>(handler->getListener())->onEvent(*event);
-		}	
+		if (event->m_pool != nullptr)
+			event->m_pool->recycle(event);
+		else
+			delete event;
+	}
 
-		//event process complete
-		m_events.pop();
-		delete event;
-		doneEvent();		
+	// Called with |m_queueMutex| held.
+	EventQueue& getQueue(size_t type) {
+		if (m_queues.size() <= type)
+			m_queues.resize(type + 1);
+		return m_queues[type];
 	}
-	void doneEvent() {
-		std::lock_guard<std::mutex> lock(m_mutex);
 
-		m_processing = false;		
+	// Called with |m_queueMutex| held. Queues |event| of |type| according
+	// to the type's policy and returns the event it discarded, if any.
+	Event* enqueue(size_t type, Event* event) {
+		EventQueue &queue = getQueue(type);
+		if (queue.coalesce) {
+			// Same key, so |slots| stays as it is.
+			Event **queued = queue.find(event);
+			if (queued != nullptr) {
+				Event *replaced = *queued;
+				*queued = event;
+				queue.stats.coalesced++;
+				return replaced;
+			}
+		}
+
+		if (queue.capacity != 0 && queue.events.size() >= queue.capacity) {
+			queue.stats.dropped++;
+			if (queue.policy == DROP_NEWEST)
+				return event;
 
-		//schedule next event
-		if (!m_events.empty())
-			scheduleEvent();
+			// The oldest leaves and the newest joins, the type keeps its
+			// place in |m_order|.
+			Event *oldest = queue.pop();
+			queue.push(event);
+			return oldest;
+		}
+
+		queue.push(event);
+		m_order.push_back(type);
+		if (queue.events.size() > queue.stats.peak)
+			queue.stats.peak = queue.events.size();
+		return nullptr;
+	}
+
+	/**
+	* \brief background event handler, run on the pool
+	*/
+	void processEvents() {
+		for (;;) {
+			Event *event;
+			size_t type;
+			{
+				std::lock_guard<std::mutex> lock(m_queueMutex);
+				if (m_order.empty()) {
+					m_processing = false;
+					return;
+				}
+				type = m_order.front();
+				m_order.pop_front();
+				event = m_queues[type].pop();
+			}
+
+			deliver(event, type);
+			release(event);
+		}
 	}
 private:
-	typedef std::list<EventHandler*> HandlerList_t;
-	typedef std::map<std::type_index, HandlerList_t*> HandlerMap_t;
-	HandlerMap_t m_handlers;
-	std::queue<Event*> m_events;
-	std::mutex m_mutex;
+	std::shared_ptr<const HandlerTable_t> m_table;
+	std::mutex m_mutex;	//serializes table writers
+	std::vector<std::unique_ptr<Mailbox> > m_mailboxes;
+	std::vector<std::unique_ptr<ListenerStats> > m_stats;	//kept while the bus lives, snapshots may point at them
+	std::vector<EventQueue> m_queues;	//indexed by event type id
+	std::deque<size_t> m_order;	//type of each queued event, in arrival order
+	std::mutex m_queueMutex;
 	bool m_processing;
+	DrainTask m_drain;
 	ThreadPool m_threadpool;
 };
 
@@ -20,6 +20,22 @@
 #ifndef _UTILS_EVENTLOCK_H_
 #define _UTILS_EVENTLOCK_H_
 
+#include <atomic>
+#include <limits.h>
+#include <mutex>
+
+// Largest initial count, leaves room for posts on top of it. Larger
+// requests, like an unbounded SIZE_MAX queue capacity, are clamped to it.
+#define EVENTLOCK_VALUE_MAX (INT_MAX / 2)
+
+/**
+ * \brief Counting semaphore that can be exported as an eventfd
+ *
+ * The count lives in an atomic word and waiters sleep on a futex, so Post,
+ * Wait and TryWait stay in userspace. The first GetFd() creates a
+ * non-blocking EFD_SEMAPHORE eventfd and moves the count into it, from then
+ * on the fd carries the count so it can be watched by a Reactor.
+ */
 class EventLock {
 public:
 	EventLock(int value);
@@ -28,13 +44,17 @@ public:
     int Wait();
     bool TryWait();
     int Post();
-    int GetFd() {return m_fd;}
+    int GetFd();
     
 protected:
     void New(int value);
     void Free();
+    bool TakeCount();
+    int WaitFd();
     
 private:
+    std::atomic<int> m_count;	//count, -1 for none with sleepers, kExported once in the fd
+    std::mutex m_mutex;
     int m_fd;
 };
 
@@ -20,24 +20,55 @@
 #ifndef _UTILS_FUTURE_H_
 #define _UTILS_FUTURE_H_
 
-class EventLock;
+#include "concurrency.h"
+#include "thread.h"
 
+/**
+ * \brief Result of an asynchronous operation
+ *
+ * Await() blocks for the result, Then() instead runs a function with it
+ * once it is ready, on a chosen Thread, without parking any thread. The
+ * continuations sit in a lock-free list that Ready() swaps for a marker,
+ * so a Future only reaches the kernel when somebody actually blocks.
+ */
 class Future {
 public:
+	// One Then() callback, linked into the future until it is ready.
+	typedef struct continuation_t {
+		Thread *thread;
+		thread_fn func;
+		void *context;
+		bool owned;	//allocated by Then(), freed once it ran
+		struct continuation_t *next;
+	}continuation_t;
+
 	Future(void *value = NULL);
     ~Future();
     
 	void Ready(void *value);
 	void* Await();   
+	bool IsReady();
+	void* GetResult();
+	void Then(Thread *thread, thread_fn func, void *context);
+	void Then(continuation_t *continuation, Thread *thread, thread_fn func, void *context);
+
+	static Future* WhenAll(Future **futures, size_t count, void **results = NULL);
+	static Future* WhenAny(Future **futures, size_t count);
     
 protected:
     void New(void *value);
     void Free();
+
+	void add_continuation(continuation_t *continuation);
+	static void run_continuation(continuation_t *continuation, void *result);
     
 private:
+	static continuation_t* const kReady;
+
 	bool m_ready;
 	void *m_result;
-	EventLock *m_event;
+	std::atomic<continuation_t*> m_continuations;	//kReady once the result is set
+	EventFlag m_event;	//set last, once Ready() is done with the future
 };
 
 #endif //_UTILS_FUTURE_H_
@@ -21,10 +21,12 @@
 #define _UTILS_MODULE_H_
 #include <mutex>
 #include <map>
+#include <vector>
 
 #define MAX_MODULE_DEPENDENCIES			10
 
 class Future;
+class ModuleTask;
 
 class Module {
 public:
@@ -60,6 +62,8 @@ public:
 	bool module_start_up(const module_t* module);
 	void module_shut_down(const module_t* module);
 	void module_clean_up(const module_t* module);
+	bool module_start_up_all(const module_t* const* modules, size_t count);
+	bool module_shut_down_all(const module_t* const* modules, size_t count);
 	const module_t* get_module(const char* name);
 	module_state_t get_module_state(const module_t* module);
 	void set_module_state(const module_t* module, module_state_t state);
@@ -69,6 +73,9 @@ protected:
 	void start(void);
 	void stop(void);
 	bool invoke_lifecycle_function(module_lifecycle_fn fun);
+	bool build_graph(const module_t* const* modules, size_t count, bool reverse,
+		std::vector<ModuleTask*> &nodes);
+	bool run_graph(std::vector<ModuleTask*> &nodes, bool shutting_down);
 private:
 	static ModuleManager m_instance;
 	std::mutex m_mutex;
@@ -0,0 +1,62 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+#ifndef _UTILS_PLACEMENT_H_
+#define _UTILS_PLACEMENT_H_
+#include <sched.h>
+#include <sys/types.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+/**
+ * \brief CPU placement policy for stack threads, keyed by thread name
+ *
+ * Rules are read from the BLUEGENIUS_THREAD_PLACEMENT environment variable
+ * or given through LoadConfig(), e.g.
+ *   "alarm_dispatcher,hci_thread=3;bt_a2dp_source=2-3;isolate"
+ * pins alarm_dispatcher and hci_thread to core 3 and bt_a2dp_source to
+ * cores 2 and 3. With "isolate" every thread without a rule is kept off
+ * the cores named by the rules.
+ */
+class ThreadPlacement {
+public:
+	bool LoadConfig(const char* config);
+	bool AddRule(const char* name, const cpu_set_t* cpus);
+	void RemoveRule(const char* name);
+	void SetIsolation(bool isolate);
+	bool Apply(pid_t tid, const char* name);
+	int GetNumaNode(const cpu_set_t* cpus);
+
+	static ThreadPlacement& GetInstance();
+protected:
+	ThreadPlacement();
+	~ThreadPlacement() {}
+
+	bool parse_cpu_list(const char* list, cpu_set_t* cpus);
+	void update_reserved();
+private:
+	static const char* kConfigEnv;
+	std::mutex m_mutex;
+	std::map<std::string, cpu_set_t> m_rules;
+	cpu_set_t m_reserved;
+	bool m_isolate;
+};
+
+#endif //_UTILS_PLACEMENT_H_
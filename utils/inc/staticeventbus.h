@@ -0,0 +1,117 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+#ifndef _UTILS_STATICEVENTBUS_H_
+#define _UTILS_STATICEVENTBUS_H_
+#include <stddef.h>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "eventbus.h"
+
+/**
+ * \brief Type lists used to declare a StaticEventBus
+ */
+template<typename... Events>
+struct EventList {};
+
+template<typename... Listeners>
+struct ListenerList {};
+
+template<typename EventTypes, typename ListenerTypes>
+class StaticEventBus;
+
+/**
+ * \brief Event bus whose events and listeners are fixed at build time
+ *
+ *   typedef StaticEventBus<EventList<ScanEvent, ConnEvent>,
+ *                          ListenerList<Gap, Gatt, Hid> > CoreBus;
+ *   CoreBus bus(gap, gatt, hid);
+ *   bus.dispatchEvent(event);
+ *
+ * Every listener that has an onEvent() taking the event is called
+ * directly, in list order, on the publisher's thread. The routing is
+ * resolved by the compiler: no heap, no type lookup and no virtual call,
+ * so the handlers can be inlined. The bus does not own the listeners or
+ * the event. Plugins keep using the dynamic EventBus; the same Event and
+ * IEventListener types work with both.
+ */
+template<typename... Events, typename... Listeners>
+class StaticEventBus<EventList<Events...>, ListenerList<Listeners...> > {
+public:
+	explicit StaticEventBus(Listeners&... listeners)
+		: m_listeners(listeners...) {
+		static_assert(allOf<std::is_base_of<Event, Events>::value...>::value,
+			"StaticEventBus: every event must be a class derived from Event");
+	}
+	~StaticEventBus() {}
+
+	template<typename T>
+	void dispatchEvent(T& event) {
+		static_assert(anyOf<std::is_same<T, Events>::value...>::value,
+			"StaticEventBus::dispatchEvent<T>: T is not in the EventList of this bus");
+		deliver<T, 0>(event);
+	}
+
+	// Number of listeners an event of type T reaches, known at compile time.
+	template<typename T>
+	static constexpr size_t listenerCount() {
+		return countOf<hasOnEvent<Listeners, T>::value...>::value;
+	}
+
+protected:
+	template<bool... B>
+	struct allOf : std::is_same<allOf<B...>, allOf<(B || true)...> > {};
+	template<bool... B>
+	struct anyOf : std::integral_constant<bool, !allOf<!B...>::value> {};
+	template<bool... B>
+	struct countOf : std::integral_constant<size_t, 0> {};
+	template<bool H, bool... B>
+	struct countOf<H, B...> : std::integral_constant<size_t, (H ? 1 : 0) + countOf<B...>::value> {};
+
+	template<typename L, typename T, typename = void>
+	struct hasOnEvent : std::false_type {};
+	template<typename L, typename T>
+	struct hasOnEvent<L, T, decltype(std::declval<L&>().onEvent(std::declval<T&>()), void())>
+		: std::true_type {};
+
+	template<typename T, size_t I>
+	typename std::enable_if<(I < sizeof...(Listeners))>::type deliver(T& event) {
+		typedef typename std::tuple_element<I, std::tuple<Listeners...> >::type L;
+		call(std::get<I>(m_listeners), event, hasOnEvent<L, T>());
+		deliver<T, I + 1>(event);
+	}
+	template<typename T, size_t I>
+	typename std::enable_if<(I == sizeof...(Listeners))>::type deliver(T&) {}
+
+	// The qualified call binds to L's own onEvent(), so even an override of
+	// IEventListener<T>::onEvent() is called without a virtual dispatch.
+	template<typename L, typename T>
+	static void call(L& listener, T& event, std::true_type) {
+		listener.L::onEvent(event);
+	}
+	template<typename L, typename T>
+	static void call(L&, T&, std::false_type) {}
+
+private:
+	std::tuple<Listeners&...> m_listeners;
+};
+
+#endif //_UTILS_STATICEVENTBUS_H_
@@ -21,16 +21,27 @@
 #define _UTILS_THREAD_H_
 
 #include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #define THREAD_NAME_MAX       		(16)//PR_SET_NAME limit max name length 16 bytes
 #define DEFAULT_WORK_QUEUE_CAPACITY (128)
 
+#define THREAD_TIMER_INVALID		(0)
+
 typedef void(*thread_fn)(void* context, void* arg);
+// Handle of a delayed or periodic post, see Thread::Cancel
+typedef uint64_t thread_timer_id_t;
 
 class Reactor;
 class FixedQueue;
+class SeqList;
+struct thread_timer_t;
 
 class Thread {	 
 public:
@@ -38,10 +49,15 @@ public:
 	~Thread();
 	
 	void Post(thread_fn func, void* context, void* arg = NULL);
+	thread_timer_id_t PostDelayed(thread_fn func, void* context, void* arg, uint64_t delay_ms);
+	thread_timer_id_t PostPeriodic(thread_fn func, void* context, void* arg, uint64_t period_ms);
+	bool Cancel(thread_timer_id_t timer);
 	void Stop();
 	void Join();
 	bool SetPriority(int priority);
 	bool SetRTPriority(int priority);
+	bool SetAffinity(int cpu);
+	bool SetAffinity(const cpu_set_t* cpus);
 	bool IsSelf();	
 	Reactor* GetReactor() {return m_reactor;}
 	FixedQueue* GetWorkqueue() {return m_workqueue;}
@@ -52,8 +68,14 @@ protected:
 	void Free();	
 	void* Run(void* arg);
 	
+	void DrainOverflow();
+	thread_timer_id_t AddTimer(thread_fn func, void* context, void* arg,
+		uint64_t delay_ms, uint64_t period_ms);
+	void ArmTimer();
+
 	static void* RunThread(void* arg);
 	static void WorkqueueReady(void* context);
+	static void TimerReady(void* context);
 private:
 	std::atomic<bool> m_isjoined;
 	pthread_t m_thread;
@@ -61,6 +83,16 @@ private:
 	char m_name[THREAD_NAME_MAX + 1];
 	Reactor* m_reactor;
 	FixedQueue* m_workqueue;
+	SeqList* m_overflow;	//same-thread posts that found |m_workqueue| full
+
+	// Delayed and periodic posts, ordered by deadline and fired from
+	// |m_timerfd| on this thread's reactor.
+	int m_timerfd;
+	std::mutex m_timerMutex;
+	std::map<thread_timer_id_t, thread_timer_t*> m_timers;
+	std::set<std::pair<uint64_t, thread_timer_id_t>> m_timerQueue;
+	thread_timer_id_t m_nextTimer;
+	thread_timer_id_t m_firingTimer;
 };
 
 
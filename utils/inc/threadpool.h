@@ -19,15 +19,24 @@
 *********************************************************************************/
 #ifndef _UTIL_THREADPOOL_H_
 #define _UTIL_THREADPOOL_H_
-#include <map>
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <vector>
 #include <mutex>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/types.h>
 
-class ConCurrency;
+class ThreadPool;
 
 /**
  * \brief The base task class, all tasks inherit from this class
+ *
+ * A task is a one-shot unit of work: every ThreadPool::submit() runs it
+ * exactly once. The pool never takes ownership of a task, and a task must
+ * not be submitted again before it started running.
  */
 class Task {
 public:
@@ -38,12 +47,67 @@ public:
 	};
 	Task(Priority p = NORMAL)
 		:m_priority(p) {}
-	~Task() {}
+	virtual ~Task() {}
 
 	virtual void run() = 0;
+	Priority get_priority() { return m_priority; }
 
 private:
+	friend class ThreadPool;
 	Priority m_priority;
+	uint64_t m_submitted;	//submit time, ns
+};
+
+// Queueing latency of the tasks of one priority, submit to start of run().
+typedef struct {
+	size_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+}task_stats_t;
+
+/**
+ * \brief Chase-Lev work-stealing deque with a fixed capacity
+ *
+ * Only the owning worker may push() and pop() at the bottom, any thread
+ * may steal() from the top.
+ */
+class TaskDeque {
+public:
+	TaskDeque();
+	~TaskDeque() {}
+
+	bool push(Task *task);
+	Task *pop();
+	Task *steal();
+	bool empty();
+
+private:
+	static const int64_t kCapacity = 1024;
+	std::atomic<int64_t> m_top;
+	std::atomic<int64_t> m_bottom;
+	std::atomic<Task*> m_tasks[kCapacity];
+};
+
+/**
+ * \brief Counts outstanding tasks, ThreadPool::wait() returns once it drops to zero
+ */
+class TaskLatch {
+public:
+	TaskLatch(size_t count = 0);
+	~TaskLatch() {}
+
+	void add(size_t count = 1);
+	void done();
+	bool ready() { return m_event.is_set(); }
+
+protected:
+	friend class ThreadPool;
+	void wait();
+	bool wait_for(uint64_t timeout_ms);
+
+private:
+	std::atomic<size_t> m_count;
+	EventFlag m_event;
 };
 
 class Worker {
@@ -54,50 +118,173 @@ public:
 		SUSPENDED,
 		DEAD
 	};
-	Worker();
-	Worker(bool suspend, bool detached, const char *name);
+	Worker(ThreadPool *pool, int index, const char *name);
 	~Worker();
 	
 	bool start();
 	void stop();
 	bool join();
-	void suspend();
-	void schedule();
-	void add_task(int task_id, Task *task);
-	void remove_task(int task_id);
+	void wake();
 	int get_priority();
 	void set_priority(int priority);
+	bool set_affinity(int cpu);
+	bool set_affinity(const cpu_set_t *cpus);
 	State get_state() { return m_state; }
 	void set_state(State state) { m_state = state; }
 protected:
+	friend class ThreadPool;
 	void run();
 	static void *main_loop(void *arg);
 
 private:
-	bool m_detached;
-	State m_state;
+	ThreadPool *m_pool;
+	int m_index;
+	std::atomic<State> m_state;
 	pthread_t m_tid;
-	ConCurrency m_con;
-	std::map<int, Task*> m_tasks;
+	bool m_joinable;
+	pid_t m_ktid;
+	int m_level;	//priority whose scheduling mapping is applied, -1 for none
+	char m_name[16];
+	Semaphore m_sem;
+	TaskDeque m_deques[Task::HIGH + 1];
 };
 
+/**
+ * \brief Work-stealing thread pool
+ *
+ * Tasks submitted from one of the pool's own workers go to that worker's
+ * deque, everything else goes through a global injection queue. Workers
+ * out of local work drain the injection queue, then steal from their
+ * peers, and park once there is nothing left anywhere.
+ *
+ * Each priority has its own deques and injection queue and higher
+ * priorities are served first. An injected task is promoted one level for
+ * every aging period it waits, so bulk work can't starve. LOW tasks are
+ * always injected, even from a worker, so that this covers all of them.
+ *
+ * The pool is elastic between |min_threads| and |max_threads|: a worker is
+ * spawned when no worker is idle and queued work has waited longer than
+ * the grow threshold, and a worker idle for longer than the idle timeout
+ * retires while more than |min_threads| are running.
+ */
 class ThreadPool {
 public:
-	ThreadPool(int threads);
+	static const int kPriorityLevels = Task::HIGH + 1;
+
+	ThreadPool(int min_threads = 1, int max_threads = 0);
 	~ThreadPool();
 
-	bool push(Worker* worker);
-	Worker* peek();
-	bool pop(Worker* worker);
-	void flush();
+	void submit(Task *task);
+	void wait(TaskLatch &latch);
+	void parallel_for(size_t begin, size_t end,
+		const std::function<void(size_t, size_t)> &body, size_t grain = 0);
+	int size() { return m_active.load(); }
+	void set_aging(uint64_t aging_ms) { m_agingNs = aging_ms * 1000000ULL; }
+	void set_elasticity(uint64_t grow_ms, uint64_t idle_timeout_ms);
+	size_t get_spawn_count() { return m_spawned.load(); }
+	size_t get_retire_count() { return m_retired.load(); }
+	void set_priority_mapping(Task::Priority priority, int policy, int value);
+	task_stats_t get_stats(Task::Priority priority);
 
 protected:
+	friend class Worker;
+	friend class RangeTask;
+	bool wants_split();
+	Task *take(Worker *worker);
+	Task *take_aged(int level, uint64_t now);
+	Task *take_injected(int level);
+	Task *pop_injected(int level);
+	Task *steal(Worker *thief, int level);
+	void account(Worker *worker, Task *task);
+	bool park(Worker *worker);
+	void grow(uint64_t now);
+	uint64_t oldest_wait(uint64_t now);
+	void wake_one();
+	bool has_work();
 	void terminate();
 
 private:
-	static const int kMaxThreadNum;
-	std::vector<std::pair<Worker*, bool>> m_threads;
-	std::mutex m_mutex;
+	std::vector<Worker*> m_workers;		//|max_threads| slots, started on demand
+	std::mutex m_resizeMutex;
+	int m_min;
+	int m_max;
+	bool m_stopping;
+	std::atomic<int> m_active;
+	std::atomic<uint64_t> m_growNs;
+	std::atomic<uint64_t> m_idleTimeoutMs;
+	std::atomic<uint64_t> m_lastSpawn;
+	std::atomic<size_t> m_spawned;
+	std::atomic<size_t> m_retired;
+	std::mutex m_mutex;					//guards |m_injection| and |m_idle|
+	std::deque<Task*> m_injection[kPriorityLevels];
+	std::atomic<size_t> m_injected[kPriorityLevels];
+	std::atomic<uint64_t> m_oldest[kPriorityLevels];	//submit time of each queue head
+	std::vector<Worker*> m_idle;
+	std::atomic<int> m_idleCount;
+	std::atomic<uint64_t> m_agingNs;
+
+	struct {
+		std::atomic<bool> enabled;
+		int policy;		//SCHED_OTHER maps to a nice value, otherwise rt priority
+		int value;
+	} m_mapping[kPriorityLevels];
+
+	struct {
+		std::atomic<size_t> count;
+		std::atomic<uint64_t> total_us;
+		std::atomic<uint64_t> max_us;
+	} m_stats[kPriorityLevels];
+
+	static thread_local Worker *ms_current;
+};
+
+/**
+ * \brief Dependency graph of tasks run on a ThreadPool
+ *
+ *   TaskGraph graph(&pool);
+ *   TaskGraph::node_t a = graph.add(load), b = graph.add(parse_keys),
+ *       c = graph.add(parse_links), d = graph.add(publish);
+ *   graph.precede(a, b); graph.precede(a, c);
+ *   graph.precede(b, d); graph.precede(c, d);
+ *   graph.run();
+ */
+class TaskGraph {
+public:
+	typedef size_t node_t;
+
+	TaskGraph(ThreadPool *pool);
+	~TaskGraph();
+
+	node_t add(const std::function<void()> &fn, Task::Priority priority = Task::NORMAL);
+	void precede(node_t before, node_t after);
+	bool run();
+
+protected:
+	class Node : public Task {
+	public:
+		Node(TaskGraph *graph, size_t index, const std::function<void()> &fn, Priority priority)
+			:Task(priority)
+			,m_graph(graph)
+			,m_index(index)
+			,m_fn(fn)
+			,m_predecessors(0)
+			,m_pending(0) {}
+		virtual void run();
+	private:
+		friend class TaskGraph;
+		TaskGraph *m_graph;
+		size_t m_index;
+		std::function<void()> m_fn;
+		std::vector<Node*> m_successors;
+		size_t m_predecessors;
+		std::atomic<size_t> m_pending;
+	};
+	bool has_cycle();
+
+private:
+	ThreadPool *m_pool;
+	std::vector<Node*> m_nodes;
+	TaskLatch m_latch;
 };
 
 
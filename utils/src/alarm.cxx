@@ -21,15 +21,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <malloc.h>
 #include <pthread.h>
-#include <signal.h>
+#include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 #include "utils.h"
 #include "allocator.h"
+#include "concurrency.h"
 #include "seqlist.h"
 #include "eventlock.h"
 #include "fixed_queue.h"
@@ -41,28 +50,207 @@
 // meet audio deadlines.  Use this priority for all audio/timer related thread.
 static const int THREAD_RT_PRIORITY = 1;
 
+// Deadlines further out than this are armed on the wakeup timer, so that
+// they can bring the system out of suspend.
+static const uint64_t TIMER_INTERVAL_FOR_WAKEUP_IN_MS = 3000;
 
-Alarm::Alarm() { 
+static const uint64_t NS_PER_SEC = 1000000000LL;
+
+// Percentiles shown by Dump().
+static const int DUMP_PERCENTILES[] = { 50, 90, 99 };
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t boottime_us(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_BOOTTIME, &ts) == -1) {
+		LOG_ERROR(LOG_TAG, "unable to get current time: %s", strerror(errno));
+		return 0;
+	}
+	return (ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000LL);
+}
+
+static pid_t current_tid(void) {
+	static thread_local pid_t tid = 0;
+	if (tid == 0) tid = gettid();
+	return tid;
+}
+
+// Marks the callback of |alarm| as running on this thread, called with the
+// lock of its instance held.
+static void callback_begin(alarm_data_t *alarm) {
+	alarm->callback_state.store(current_tid(), std::memory_order_relaxed);
+}
+
+// Marks the callback of |alarm| done, wakes whoever waits to cancel it, and
+// recycles the alarm if the callback freed it.
+static void callback_end(alarm_data_t *alarm) {
+	int state = alarm->callback_state.exchange(0, std::memory_order_acq_rel);
+	if (state & ALARM_CALLBACK_WAITERS)
+		futex_wake(&alarm->callback_state, INT_MAX);
+	if (state & ALARM_CALLBACK_FREE_PENDING)
+		AlarmSlab::GetInstance().Recycle(alarm);
+}
+
+// Waits until the callback of |alarm| in progress, if any, returns. A
+// callback canceling its own alarm doesn't wait for itself.
+static void wait_callback(alarm_data_t *alarm) {
+	pid_t self = current_tid();
+	int state = alarm->callback_state.load(std::memory_order_acquire);
+	while (state != 0 && (state & ALARM_CALLBACK_TID_MASK) != self) {
+		if (!(state & ALARM_CALLBACK_WAITERS) &&
+			!alarm->callback_state.compare_exchange_weak(state, state | ALARM_CALLBACK_WAITERS,
+				std::memory_order_acquire))
+			continue;
+		futex_wait(&alarm->callback_state, state | ALARM_CALLBACK_WAITERS, NULL);
+		state = alarm->callback_state.load(std::memory_order_acquire);
+	}
+}
+
+// Gives a freed alarm back to the slab. When its own callback is freeing
+// it, callback_end() does that once the callback returns.
+static void release_alarm(alarm_data_t *alarm) {
+	int state = alarm->callback_state.load(std::memory_order_acquire);
+	if (state != 0 && (state & ALARM_CALLBACK_TID_MASK) == current_tid()) {
+		alarm->callback_state.fetch_or(ALARM_CALLBACK_FREE_PENDING, std::memory_order_relaxed);
+		return;
+	}
+	AlarmSlab::GetInstance().Recycle(alarm);
+}
+
+// Timers are kept on an intrusive list so creating one never allocates.
+static void link_timer(alarm_data_t **head, alarm_data_t *alarm) {
+	alarm->prev = NULL;
+	alarm->next = *head;
+	if (*head != NULL) (*head)->prev = alarm;
+	*head = alarm;
+}
+
+static void unlink_timer(alarm_data_t **head, alarm_data_t *alarm) {
+	if (alarm->prev != NULL) alarm->prev->next = alarm->next;
+	else *head = alarm->next;
+	if (alarm->next != NULL) alarm->next->prev = alarm->prev;
+	alarm->prev = alarm->next = NULL;
+}
+
+// Records how far from its deadline a callback started, both in us.
+static void update_scheduling_stats(alarm_stats_t *stats, uint64_t now_us, uint64_t deadline_us) {
+	stats->total_updates++;
+	stats->last_update_ms = now_us / 1000;
+
+	if (deadline_us < now_us)
+		stats->overdue_scheduling.Record(now_us - deadline_us);
+	else if (deadline_us > now_us)
+		stats->premature_scheduling.Record(deadline_us - now_us);
+}
+
+// |remaining_us| is only meaningful when |scheduled|.
+static void dump_timer(int fd, alarm_data_t *alarm, bool scheduled, uint64_t period_us,
+	uint64_t remaining_us) {
+	alarm_stats_t *stats = &alarm->stats;
+	alarm_histogram_t *overdue = &stats->overdue_scheduling;
+	alarm_histogram_t *premature = &stats->premature_scheduling;
+
+	dprintf(fd, "  Alarm : %s (%s)\n", stats->name, alarm->isPeriodic ? "PERIODIC" : "SINGLE");
+	dprintf(fd, "    Action counts (sched/resched/exec/cancel)     : %10zu %10zu %10zu %10zu\n",
+		stats->scheduled_count, stats->rescheduled_count, stats->total_updates,
+		stats->canceled_count);
+	dprintf(fd, "    Deviation counts (overdue/premature)          : %10zu %10zu\n",
+		overdue->count, premature->count);
+	dprintf(fd, "    Wakeups saved / periods missed                : %10zu %10zu\n",
+		stats->wakeups_saved, stats->missed_periods);
+	if (scheduled)
+		dprintf(fd, "    Time in us (interval/remaining)               : %10" PRIu64 " %10" PRIu64 "\n",
+			period_us, remaining_us);
+	else
+		dprintf(fd, "    Time in us (interval/remaining)               : %10" PRIu64 " %10s\n",
+			period_us, "-");
+	char label[64];
+	int len = snprintf(label, sizeof(label), "Callback overdue us (avg");
+	for (size_t i = 0; i < sizeof(DUMP_PERCENTILES) / sizeof(DUMP_PERCENTILES[0]); i++)
+		len += snprintf(label + len, sizeof(label) - len, "/p%d", DUMP_PERCENTILES[i]);
+	snprintf(label + len, sizeof(label) - len, "/max)");
+	dprintf(fd, "    %-46s: %10" PRIu64, label,
+		overdue->count ? overdue->total_us / overdue->count : 0);
+	for (size_t i = 0; i < sizeof(DUMP_PERCENTILES) / sizeof(DUMP_PERCENTILES[0]); i++)
+		dprintf(fd, " %10" PRIu64, overdue->Percentile(DUMP_PERCENTILES[i]));
+	dprintf(fd, " %10" PRIu64 "\n", overdue->max_us);
+	dprintf(fd, "    Callback premature us (avg/max)               : %10" PRIu64 " %10" PRIu64 "\n",
+		premature->count ? premature->total_us / premature->count : 0, premature->max_us);
+}
+
+
+Alarm::Alarm() 
+	:m_timers(NULL)
+	,m_timerCount(0)
+	,m_deadlines(&alarm_data_t::deadline, &alarm_data_t::heap_index)
+	,m_latest(&alarm_data_t::latest, &alarm_data_t::latest_index)
+	,m_armedDeadline(0)
+	,m_batchLimit(0)
+	,m_batchDeadline(0)
+	,m_batchStale(true)
+	,m_timerfd(INVALID_FD)
+	,m_wakeupfd(INVALID_FD)
+	,m_timerObject(NULL)
+	,m_wakeupObject(NULL)
+	,m_callbackThread(NULL)
+	,m_dispatchThread(NULL)
+{ 
 	CHECK(lazy_initialize());
 }
 
 Alarm::~Alarm(){
+	m_dispatchThread->GetReactor()->Unregister(m_timerObject);
+	if (m_wakeupObject != NULL)
+		m_dispatchThread->GetReactor()->Unregister(m_wakeupObject);
+	delete m_dispatchThread;
+
+	for (size_t i = 0; i < m_lanes.size(); i++)
+		free_lanes(m_lanes[i]);
+	delete m_callbackThread;
+
+	close(m_timerfd);
+	if (m_wakeupfd != INVALID_FD) close(m_wakeupfd);
 }
 
 alarm_data_t* Alarm::CreateTimer(const char* name, bool is_periodic) {
-	alarm_data_t *timer = static_cast<alarm_data_t*>(sys_malloc(sizeof(alarm_data_t)));
-
-	CHECK(timer != NULL);
+	alarm_data_t *timer = AlarmSlab::GetInstance().Acquire(name, is_periodic);
 
-	timer->isPeriodic = is_periodic;
-	timer->stats.name = sys_strdup(name);
-	timer->callback_mutex = new std::recursive_mutex;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	link_timer(&m_timers, timer);
+	++m_timerCount;
 
 	return timer;
 }
 
-void Alarm::SetTimer(alarm_data_t *timer, uint64_t interval, callback_func_t cb, void *data) {
+void Alarm::FreeTimer(alarm_data_t *timer) {
+	if (timer == NULL) return;
+
+	CancelTimer(timer);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		unlink_timer(&m_timers, timer);
+		--m_timerCount;
+	}
+	release_alarm(timer);
+}
+
+// |slack| lets the alarm fire up to that many ms late when this saves a
+// wakeup, leave it 0 for alarms that must be exact, like audio ones.
+// The callback runs on |thread|, or on the default callback thread when
+// it is NULL. |thread| must stay alive until ReleaseThread() is called.
+void Alarm::SetTimer(alarm_data_t *timer, uint64_t interval, callback_func_t cb, void *data,
+	uint64_t slack, Thread *thread, alarm_priority_t priority) {
 	CHECK(timer != NULL);
+	CHECK(cb != NULL);
+	CHECK(!timer->isPeriodic || interval != 0);
+	CHECK(priority < ALARM_PRIORITY_MAX);
 
 	std::lock_guard<std::mutex> lock(m_mutex);
 
@@ -70,116 +258,549 @@ void Alarm::SetTimer(alarm_data_t *timer, uint64_t interval, callback_func_t cb,
 	timer->period = interval;
 	timer->callback_func = cb;
 	timer->data = data;
-	timer->queue = m_callbackQueue;
+	timer->slack = slack;
+
+	// Rescheduling may move the alarm to other lanes, it mustn't fire on
+	// the old ones any more.
+	if (timer->queued)
+		timer->queue->Remove(timer);
+	timer->queued = false;
+	timer->queue = get_lanes(thread)->queues[priority];
 
 	schedule_next_instance(timer);
 	++timer->stats.scheduled_count;
 }
 
-bool Alarm::create_timer(const clockid_t clock_id, timer_t* timer) {
-	CHECK(timer == NULL);
+void Alarm::CancelTimer(alarm_data_t *timer) {
+	CHECK(timer != NULL);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		cancel_internal(timer);
+	}
+
+	// If the callback for |timer| is in progress, wait here until it completes.
+	wait_callback(timer);
+}
+
+// Cancels every alarm that runs on |thread| and takes its lanes off the
+// thread's reactor. Must be called before |thread| is deleted.
+void Alarm::ReleaseThread(Thread *thread) {
+	CHECK(thread != NULL);
+	CHECK(thread != m_callbackThread);
+
+	alarm_lanes_t *lanes = NULL;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t i = 0; i < m_lanes.size(); i++) {
+			if (m_lanes[i]->thread == thread) {
+				lanes = m_lanes[i];
+				m_lanes.erase(m_lanes.begin() + i);
+				break;
+			}
+		}
+		if (lanes == NULL) return;
+
+		std::vector<alarm_data_t*> routed;
+		for (size_t i = 0; i < m_deadlines.GetSize(); i++) {
+			alarm_data_t *alarm = m_deadlines.At(i);
+			for (int p = 0; p < ALARM_PRIORITY_MAX; p++)
+				if (alarm->queue == lanes->queues[p]) routed.push_back(alarm);
+		}
+		for (size_t i = 0; i < routed.size(); i++)
+			cancel_internal(routed[i]);
+
+		// Expired alarms still waiting for their callback.
+		for (int p = 0; p < ALARM_PRIORITY_MAX; p++) {
+			alarm_data_t *alarm;
+			while ((alarm = static_cast<alarm_data_t*>(lanes->queues[p]->TryDequeue())) != NULL) {
+				alarm->queued = false;
+				cancel_internal(alarm);
+			}
+		}
+	}
+
+	// Outside of |m_mutex|: unregistering waits for a callback in progress
+	// on the lanes, and that one takes |m_mutex| itself.
+	free_lanes(lanes);
+}
+
+bool Alarm::IsScheduled(alarm_data_t *timer) {
+	if (timer == NULL) return false;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return timer->callback_func != NULL;
+}
+
+uint64_t Alarm::GetRemainingMs(alarm_data_t *timer) {
+	CHECK(timer != NULL);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint64_t just_now = now();
+	return timer->deadline > just_now ? timer->deadline - just_now : 0;
+}
+
+// Lists every live alarm with its counters, next deadline and how late
+// its callbacks started.
+void Alarm::Dump(int fd) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	uint64_t just_now = now();
+	dprintf(fd, "\nBluetooth Alarms Statistics:\n");
+	dprintf(fd, "  Total Alarms: %zu\n\n", m_timerCount);
+	for (alarm_data_t *alarm = m_timers; alarm != NULL; alarm = alarm->next) {
+		bool scheduled = m_deadlines.Contains(alarm);
+		uint64_t remaining = scheduled && alarm->deadline > just_now ? alarm->deadline - just_now : 0;
+		dump_timer(fd, alarm, scheduled, alarm->period * 1000, remaining * 1000);
+	}
+}
 
-	//create timer with rt priority thread
-	pthread_attr_t thread_attr;
-	pthread_attr_init(&thread_attr);
-	pthread_attr_setschedpolicy(&thread_attr, SCHED_FIFO);
-	struct sched_param param;
-	param.sched_priority = THREAD_RT_PRIORITY;
-	pthread_attr_setschedparam(&thread_attr, &param);
+bool Alarm::create_timer(const clockid_t clock_id, int* fd) {
+	CHECK(fd != NULL);
 
-	struct sigevent sigevt;
-	memset(&sigevt, 0, sizeof(sigevt));
-	sigevt.sigev_notify = SIGEV_THREAD;
-	sigevt.sigev_value.sival_ptr = static_cast<void*>(this);
-	sigevt.sigev_notify_function = (void(*)(union sigval))Alarm::timer_callback;
-	if (timer_create(clock_id, &sigevt, timer) == -1) {
+	*fd = timerfd_create(clock_id, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (*fd == INVALID_FD) {
 		LOG_ERROR(LOG_TAG, "%s unable to create timer with clock %d: %s", __func__,
 			clock_id, strerror(errno));
 		if (clock_id == CLOCK_BOOTTIME_ALARM) {
 			LOG_ERROR(LOG_TAG,
 				"The kernel might not have support for "
-				"timer_create(CLOCK_BOOTTIME_ALARM): "
-				"https://lwn.net/Articles/429925/");
-			LOG_ERROR(LOG_TAG,
-				"See following patches: "
-				"https://git.kernel.org/cgit/linux/kernel/git/torvalds/"
-				"linux.git/log/?qt=grep&q=CLOCK_BOOTTIME_ALARM");
+				"timerfd_create(CLOCK_BOOTTIME_ALARM), or the process "
+				"lacks CAP_WAKE_ALARM: https://lwn.net/Articles/429925/");
 		}
 		return false;
 	}
 
 	return true;
-
 }
 
 bool Alarm::lazy_initialize(void) {
-    CHECK(m_alarmList == NULL);
+    CHECK(m_callbackThread == NULL);
 
-    // timer_t doesn't have an invalid value so we must track whether
-    // the |timer| variable is valid ourselves.
-    bool timer_initialized = false;
-    bool wakeup_timer_initialized = false;
-    
     std::lock_guard<std::mutex> lock(m_mutex);
     
-    m_alarmList = new SeqList(NULL);
-    if (NULL == m_alarmList) {
-        LOG_ERROR(LOG_TAG, "%s unable to allocate alarm list.");
-        goto error;
-    }
+    if (!create_timer(CLOCK_BOOTTIME, &m_timerfd)) return false;
     
-    if (!create_timer(CLOCK_BOOTTIME, &m_timer)) goto error;
-    timer_initialized = true;
+    // Without the wakeup timer alarms still fire, but can't wake the system.
+    if (!create_timer(CLOCK_BOOTTIME_ALARM, &m_wakeupfd))
+        LOG_WARN(LOG_TAG, "%s no wakeup timer, alarms won't wake the system", __func__);
     
-    if (!create_timer(CLOCK_BOOTTIME_ALARM, &m_wakeuptimer)) goto error;
-    wakeup_timer_initialized = true;
-    
-    m_alarmExpired = new EventLock(0);
-    
-    //callback thread
+    //default callback thread, for alarms that aren't bound to one
     m_callbackThread = new Thread("alarm_default_callbacks", SIZE_MAX);
     m_callbackThread->SetRTPriority(THREAD_RT_PRIORITY);
-    m_callbackQueue = new FixedQueue(SIZE_MAX);
-    m_callbackThread->GetReactor()->Register(m_callbackQueue->GetDequeueFd(), m_callbackQueue, alarm_queue_ready, NULL);
+    m_lanes.push_back(new_lanes(m_callbackThread));
     
-    //dispatch thread
-    m_dispatchThreadActive = true;
+    //dispatch thread, its reactor watches the timers directly
     m_dispatchThread = new Thread("alarm_dispatcher");
     m_dispatchThread->SetRTPriority(THREAD_RT_PRIORITY);
-    m_dispatchThread->Post(Alarm::callback_dispatch, this);
+    m_timerObject = m_dispatchThread->GetReactor()->Register(m_timerfd, this, timer_ready, NULL);
+    if (m_wakeupfd != INVALID_FD)
+        m_wakeupObject = m_dispatchThread->GetReactor()->Register(m_wakeupfd, this, timer_ready, NULL);
 
     return true;
-error:
-    if (m_alarmList != NULL) delete m_alarmList;
-	if (m_alarmExpired != NULL) delete m_alarmExpired;
-    if (m_callbackThread != NULL) delete m_callbackThread;
-    if (m_dispatchThread != NULL) delete m_dispatchThread;
-	if (timer_initialized) timer_delete(m_timer);
-	if (wakeup_timer_initialized) timer_delete(m_wakeuptimer);
+}
+
+// Must be called with |m_mutex| held. Returns the lanes of |thread|, and
+// sets them up on its reactor the first time an alarm is bound to it.
+alarm_lanes_t* Alarm::get_lanes(Thread *thread) {
+	if (thread == NULL) return m_lanes[0];
 
-    return false;
+	for (size_t i = 0; i < m_lanes.size(); i++)
+		if (m_lanes[i]->thread == thread) return m_lanes[i];
+
+	alarm_lanes_t *lanes = new_lanes(thread);
+	m_lanes.push_back(lanes);
+	return lanes;
 }
 
+alarm_lanes_t* Alarm::new_lanes(Thread *thread) {
+	alarm_lanes_t *lanes = new alarm_lanes_t();
+	CHECK(lanes != NULL);
+
+	lanes->alarm = this;
+	lanes->thread = thread;
+	for (int p = 0; p < ALARM_PRIORITY_MAX; p++) {
+		lanes->queues[p] = new FixedQueue(SIZE_MAX);
+		lanes->objects[p] = thread->GetReactor()->Register(lanes->queues[p]->GetDequeueFd(),
+			lanes, alarm_queue_ready, NULL);
+		CHECK(lanes->objects[p] != NULL);
+	}
+
+	return lanes;
+}
+
+void Alarm::free_lanes(alarm_lanes_t *lanes) {
+	for (int p = 0; p < ALARM_PRIORITY_MAX; p++) {
+		lanes->thread->GetReactor()->Unregister(lanes->objects[p]);
+		delete lanes->queues[p];
+	}
+	delete lanes;
+}
+
+// Must be called with |m_mutex| held. Computes the next deadline of
+// |alarm| and (re)inserts it into the heap.
 void Alarm::schedule_next_instance(alarm_data_t *alarm) {
+	unschedule(alarm);
+
+	// Periodic alarms stay on the grid set by their creation time, so a
+	// late dispatch doesn't push all the following deadlines back.
+	uint64_t just_now = now();
+	uint64_t ms_into_period = 0;
+	if (alarm->isPeriodic && alarm->period != 0)
+		ms_into_period = (just_now - alarm->creation_time) % alarm->period;
+	alarm->deadline = just_now + (alarm->period - ms_into_period);
+	alarm->latest = alarm->deadline + alarm->slack;
+
+	m_deadlines.Push(alarm);
+	m_latest.Push(alarm);
+	batch_add(alarm);
+	reschedule_root_alarm();
+}
+
+// Must be called with |m_mutex| held.
+void Alarm::unschedule(alarm_data_t *alarm) {
+	if (!m_deadlines.Contains(alarm)) return;
+
+	batch_remove(alarm);
+	m_deadlines.Remove(alarm);
+	m_latest.Remove(alarm);
+}
+
+// Must be called with |m_mutex| held, once |alarm| is in the heaps. An
+// alarm that doesn't move the earliest latest time can only join the
+// batch, so walking the heap is only needed when it does.
+void Alarm::batch_add(alarm_data_t *alarm) {
+	if (m_batchStale) return;
+
+	if (m_latest.Top() == alarm)
+		m_batchStale = true;
+	else if (alarm->deadline <= m_batchLimit && alarm->deadline > m_batchDeadline)
+		m_batchDeadline = alarm->deadline;
+}
+
+// Must be called with |m_mutex| held, before |alarm| leaves the heaps. The
+// batch changes only if it was the earliest latest time or the batch's
+// last deadline.
+void Alarm::batch_remove(alarm_data_t *alarm) {
+	if (m_latest.Top() == alarm || alarm->deadline == m_batchDeadline)
+		m_batchStale = true;
+}
+
+// Must be called with |m_mutex| held.
+void Alarm::cancel_internal(alarm_data_t *alarm) {
+	if (alarm->callback_func != NULL)
+		++alarm->stats.canceled_count;
+
+	if (m_deadlines.Contains(alarm)) {
+		unschedule(alarm);
+		reschedule_root_alarm();
+	}
+
+	// Drop it from the callback queue too if it already expired.
+	if (alarm->queued)
+		alarm->queue->Remove(alarm);
+	alarm->queued = false;
+
+	alarm->deadline = 0;
+	alarm->prev_deadline = 0;
+	alarm->callback_func = NULL;
+	alarm->data = NULL;
+	alarm->queue = NULL;
+}
+
+// Must be called with |m_mutex| held. Arms the kernel timer for the next
+// batch of alarms, or disarms it when nothing is pending. Nothing is done
+// while the time of the batch stays the same.
+void Alarm::reschedule_root_alarm(void) {
+	uint64_t deadline = 0;
+	if (!m_latest.IsEmpty()) {
+		if (m_batchStale) {
+			m_batchLimit = m_latest.Top()->latest;
+			m_batchDeadline = m_deadlines.MaxKeyUpTo(m_batchLimit);
+			m_batchStale = false;
+		}
+		deadline = m_batchDeadline;
+	} else {
+		m_batchStale = true;
+	}
+	if (deadline == m_armedDeadline) return;
+	m_armedDeadline = deadline;
+
+	// A zeroed timerspec disarms a timerfd, whatever its clock.
+	struct itimerspec timer_time;
+	memset(&timer_time, 0, sizeof(timer_time));
+	struct itimerspec wakeup_time;
+	memset(&wakeup_time, 0, sizeof(wakeup_time));
+
+	if (deadline != 0) {
+		struct itimerspec *target = &timer_time;
+		uint64_t just_now = now();
+		if (m_wakeupfd != INVALID_FD && deadline > just_now &&
+			deadline - just_now >= TIMER_INTERVAL_FOR_WAKEUP_IN_MS)
+			target = &wakeup_time;
+		target->it_value.tv_sec = deadline / 1000;
+		target->it_value.tv_nsec = (deadline % 1000) * 1000000LL;
+	}
+
+	if (m_wakeupfd != INVALID_FD &&
+		timerfd_settime(m_wakeupfd, TFD_TIMER_ABSTIME, &wakeup_time, NULL) == -1)
+		LOG_ERROR(LOG_TAG, "%s unable to set wakeup timer: %s", __func__, strerror(errno));
+	if (timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &timer_time, NULL) == -1)
+		LOG_ERROR(LOG_TAG, "%s unable to set timer: %s", __func__, strerror(errno));
+}
+
+AlarmSlab& AlarmSlab::GetInstance() {
+	static AlarmSlab s_slab;
+	return s_slab;
+}
+
+AlarmSlab::AlarmSlab()
+	:m_free(NULL) {
+}
+
+AlarmSlab::~AlarmSlab() {
+	for (size_t i = 0; i < m_chunks.size(); i++)
+		delete[] m_chunks[i];
+}
+
+alarm_data_t* AlarmSlab::Acquire(const char* name, bool is_periodic) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_free == NULL)
+		Grow();
+
+	slot_t *slot = m_free;
+	m_free = slot->next;
+
+	alarm_data_t *alarm = new (&slot->storage) alarm_data_t();
+	alarm->isPeriodic = is_periodic;
+	alarm->heap_index = ALARM_NOT_SCHEDULED;
+	alarm->latest_index = ALARM_NOT_SCHEDULED;
+	alarm->stats.name = Intern(name);
+
+	return alarm;
+}
+
+void AlarmSlab::Recycle(alarm_data_t *alarm) {
+	alarm->~alarm_data_t();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	slot_t *slot = reinterpret_cast<slot_t*>(alarm);
+	slot->next = m_free;
+	m_free = slot;
 }
 
-void Alarm::timer_callback(void *arg) {
-	CHECK(arg != NULL);
-	Alarm* thiz = static_cast<Alarm*>(arg);
-	thiz->m_dispatchThread->Post(Alarm::callback_dispatch, arg);
+// Must be called with |m_mutex| held. Timer names are a small fixed set,
+// so each is copied once and shared by every timer using it.
+const char* AlarmSlab::Intern(const char* name) {
+	if (name == NULL) name = "";
+
+	std::set<std::string, std::less<> >::iterator it = m_names.find(name);
+	if (it == m_names.end())
+		it = m_names.insert(name).first;
+	return it->c_str();
+}
+
+// Must be called with |m_mutex| held.
+void AlarmSlab::Grow() {
+	slot_t *chunk = new slot_t[kChunk];
+	m_chunks.push_back(chunk);
+	for (size_t i = 0; i < kChunk; ++i) {
+		chunk[i].next = m_free;
+		m_free = &chunk[i];
+	}
 }
 
+void alarm_histogram_t::Record(uint64_t us) {
+	size_t bucket = 0;
+	if (us != 0) bucket = 64 - __builtin_clzll(us);
+	if (bucket >= ALARM_HISTOGRAM_BUCKETS) bucket = ALARM_HISTOGRAM_BUCKETS - 1;
+
+	buckets[bucket]++;
+	count++;
+	total_us += us;
+	if (us > max_us) max_us = us;
+}
+
+// Upper bound of the bucket holding the |percent|th percentile, never more
+// than the largest value recorded.
+uint64_t alarm_histogram_t::Percentile(int percent) const {
+	if (count == 0) return 0;
+
+	size_t rank = (count * percent + 99) / 100;
+	if (rank == 0) rank = 1;
+	size_t seen = 0;
+	for (size_t i = 0; i < ALARM_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += buckets[i];
+		if (seen >= rank) {
+			uint64_t bound = i == 0 ? 0 : (1ULL << i) - 1;
+			return bound < max_us ? bound : max_us;
+		}
+	}
+	return max_us;
+}
+
+void AlarmHeap::Push(alarm_data_t *alarm) {
+	m_items.push_back(alarm);
+	alarm->*m_index = m_items.size() - 1;
+	SiftUp(alarm->*m_index);
+}
+
+void AlarmHeap::Remove(alarm_data_t *alarm) {
+	size_t index = alarm->*m_index;
+	CHECK(index < m_items.size() && m_items[index] == alarm);
+
+	alarm_data_t *last = m_items.back();
+	m_items.pop_back();
+	alarm->*m_index = ALARM_NOT_SCHEDULED;
+	if (last == alarm) return;
+
+	// Move the last alarm into the hole and restore the heap order from
+	// there, it may have to go either way.
+	Place(index, last);
+	SiftUp(index);
+	SiftDown(last->*m_index);
+}
+
+// Largest key not above |limit|, 0 if there is none. Only the subtrees
+// whose root is within |limit| are visited.
+uint64_t AlarmHeap::MaxKeyUpTo(uint64_t limit) {
+	uint64_t max = 0;
+	m_pending.clear();
+	if (!m_items.empty()) m_pending.push_back(0);
+	while (!m_pending.empty()) {
+		size_t index = m_pending.back();
+		m_pending.pop_back();
+		uint64_t key = m_items[index]->*m_key;
+		if (key > limit) continue;
+
+		if (key > max) max = key;
+		if (2 * index + 1 < m_items.size()) m_pending.push_back(2 * index + 1);
+		if (2 * index + 2 < m_items.size()) m_pending.push_back(2 * index + 2);
+	}
+	return max;
+}
+
+void AlarmHeap::SiftUp(size_t index) {
+	alarm_data_t *alarm = m_items[index];
+	while (index > 0) {
+		size_t parent = (index - 1) / 2;
+		if (m_items[parent]->*m_key <= alarm->*m_key) break;
+		Place(index, m_items[parent]);
+		index = parent;
+	}
+	Place(index, alarm);
+}
+
+void AlarmHeap::SiftDown(size_t index) {
+	size_t size = m_items.size();
+	alarm_data_t *alarm = m_items[index];
+	for (;;) {
+		size_t child = 2 * index + 1;
+		if (child >= size) break;
+		if (child + 1 < size && m_items[child + 1]->*m_key < m_items[child]->*m_key)
+			child++;
+		if (alarm->*m_key <= m_items[child]->*m_key) break;
+		Place(index, m_items[child]);
+		index = child;
+	}
+	Place(index, alarm);
+}
+
+void AlarmHeap::Place(size_t index, alarm_data_t *alarm) {
+	m_items[index] = alarm;
+	alarm->*m_index = index;
+}
+
+// Runs on the dispatcher thread when one of the timerfds expired.
+void Alarm::timer_ready(void* context) {
+	CHECK(context != NULL);
+	Alarm* thiz = static_cast<Alarm*>(context);
+
+	// Re-arming resets a timerfd, so the readiness may be stale by now.
+	uint64_t expirations = 0;
+	if (read(thiz->m_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations) &&
+		(thiz->m_wakeupfd == INVALID_FD ||
+		read(thiz->m_wakeupfd, &expirations, sizeof(expirations)) != sizeof(expirations)))
+		return;
+
+	thiz->dispatch_expired();
+}
+
+// Runs on the callback thread when either of its lanes has an expired
+// alarm: takes one off the high lane if there is any, else off the normal
+// lane, and calls it. The reactor keeps calling while a lane is readable.
 void Alarm::alarm_queue_ready(void* context) {
+	CHECK(context != NULL);
+	alarm_lanes_t* lanes = static_cast<alarm_lanes_t*>(context);
+	Alarm* thiz = lanes->alarm;
+
+	std::unique_lock<std::mutex> lock(thiz->m_mutex);
+	alarm_data_t *alarm = NULL;
+	for (int p = ALARM_PRIORITY_MAX - 1; p >= 0 && alarm == NULL; p--)
+		alarm = static_cast<alarm_data_t*>(lanes->queues[p]->TryDequeue());
+	if (alarm == NULL) return;	// The alarm was probably canceled
+	alarm->queued = false;
+	if (alarm->callback_func == NULL) return;
+
+	update_scheduling_stats(&alarm->stats, boottime_us(), alarm->prev_deadline * 1000);
+
+	// A one-shot alarm is fully serviced now, reset it so that it can be
+	// set again from its own callback.
+	callback_func_t callback = alarm->callback_func;
+	void *data = alarm->data;
+	if (!alarm->isPeriodic) {
+		alarm->deadline = 0;
+		alarm->callback_func = NULL;
+		alarm->data = NULL;
+		alarm->queue = NULL;
+	}
+
+	// CancelTimer() and FreeTimer() wait for the callback from now on, or
+	// defer to its end when called from the callback itself.
+	callback_begin(alarm);
+	lock.unlock();
+
+	callback(data);
+	callback_end(alarm);
 }
 
-// Function running on |dispatcher_thread| that performs the following:
-//   (1) Receives a signal using |alarm_exired| that the alarm has expired
-//   (2) Dispatches the alarm callback for processing by the corresponding
-// thread for that alarm.
-void Alarm::callback_dispatch(void* context, void* arg) {
-    Alarm* thiz = static_cast<Alarm*>(context);
+// Runs on the dispatcher thread: hands every alarm that is due to its
+// callback queue, and re-arms the timer for the next batch.
+void Alarm::dispatch_expired(void) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The kernel timer disarmed itself when it fired.
+    uint64_t armed = m_armedDeadline;
+    m_armedDeadline = 0;
+
+    // Everything that is due goes. Alarms that were due before the
+    // armed time waited within their slack to share this wakeup.
+    uint64_t just_now = now();
+    while (!m_deadlines.IsEmpty() && m_deadlines.Top()->deadline <= just_now) {
+        alarm_data_t *alarm = m_deadlines.Top();
+        unschedule(alarm);
+        if (alarm->deadline != armed)
+            ++alarm->stats.wakeups_saved;
+
+        // Periodic alarms go straight back into the heap, the deadline
+        // they fired for is kept for the callback and its stats.
+        alarm->prev_deadline = alarm->deadline;
+        if (alarm->isPeriodic) {
+            schedule_next_instance(alarm);
+            ++alarm->stats.rescheduled_count;
+        }
+
+        // A periodic alarm whose callback overran the period is still
+        // queued, it fires once for all the periods it missed.
+        if (alarm->queued) {
+            ++alarm->stats.missed_periods;
+            continue;
+        }
+        alarm->queued = true;
+        alarm->queue->Enqueue(alarm);
+    }
 
-   
+    reschedule_root_alarm();
 }
 
 uint64_t Alarm::now(void) {
@@ -192,3 +813,218 @@ uint64_t Alarm::now(void) {
 }
 
 
+HighResAlarm::HighResAlarm(const char* name, uint64_t spin_ns)
+	:m_timers(NULL)
+	,m_timerCount(0)
+	,m_deadlines(&alarm_data_t::deadline, &alarm_data_t::heap_index)
+	,m_armedTime(0)
+	,m_spinNs(spin_ns)
+	,m_timerfd(INVALID_FD)
+	,m_timerObject(NULL)
+	,m_thread(NULL)
+{
+	m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m_timerfd == INVALID_FD)
+		LOG_ERROR(LOG_TAG, "%s unable to create timer: %s", __func__, strerror(errno));
+	CHECK(m_timerfd != INVALID_FD);
+
+	m_thread = new Thread(name);
+	m_thread->SetRTPriority(THREAD_RT_PRIORITY);
+	m_timerObject = m_thread->GetReactor()->Register(m_timerfd, this, timer_ready, NULL);
+	CHECK(m_timerObject != NULL);
+}
+
+HighResAlarm::~HighResAlarm() {
+	m_thread->GetReactor()->Unregister(m_timerObject);
+	delete m_thread;
+	close(m_timerfd);
+}
+
+alarm_data_t* HighResAlarm::CreateTimer(const char* name, bool is_periodic) {
+	alarm_data_t *timer = AlarmSlab::GetInstance().Acquire(name, is_periodic);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	link_timer(&m_timers, timer);
+	++m_timerCount;
+
+	return timer;
+}
+
+void HighResAlarm::FreeTimer(alarm_data_t *timer) {
+	if (timer == NULL) return;
+
+	CancelTimer(timer);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		unlink_timer(&m_timers, timer);
+		--m_timerCount;
+	}
+	release_alarm(timer);
+}
+
+void HighResAlarm::SetTimer(alarm_data_t *timer, uint64_t interval_ns, callback_func_t cb,
+	void *data) {
+	SetTimerAt(timer, Now() + interval_ns, interval_ns, cb, data);
+}
+
+// First fires at the absolute |deadline_ns|, then every |period_ns| after it
+// for periodic timers. Lets a media stream put its ticks on its own clock.
+void HighResAlarm::SetTimerAt(alarm_data_t *timer, uint64_t deadline_ns, uint64_t period_ns,
+	callback_func_t cb, void *data) {
+	CHECK(timer != NULL);
+	CHECK(cb != NULL);
+	CHECK(!timer->isPeriodic || period_ns != 0);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_deadlines.Contains(timer))
+		m_deadlines.Remove(timer);
+	timer->creation_time = Now();
+	timer->deadline = deadline_ns;
+	timer->period = period_ns;
+	timer->callback_func = cb;
+	timer->data = data;
+	m_deadlines.Push(timer);
+	++timer->stats.scheduled_count;
+
+	arm();
+}
+
+void HighResAlarm::CancelTimer(alarm_data_t *timer) {
+	CHECK(timer != NULL);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (timer->callback_func != NULL)
+			++timer->stats.canceled_count;
+		if (m_deadlines.Contains(timer)) {
+			m_deadlines.Remove(timer);
+			arm();
+		}
+		timer->deadline = 0;
+		timer->prev_deadline = 0;
+		timer->callback_func = NULL;
+		timer->data = NULL;
+	}
+
+	// If the callback for |timer| is in progress, wait here until it completes.
+	wait_callback(timer);
+}
+
+bool HighResAlarm::IsScheduled(alarm_data_t *timer) {
+	if (timer == NULL) return false;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return timer->callback_func != NULL;
+}
+
+// Must be called with |m_mutex| held. Arms the timerfd |m_spinNs| ahead of
+// the first deadline, or disarms it when nothing is pending.
+void HighResAlarm::arm(void) {
+	uint64_t target = 0;
+	if (!m_deadlines.IsEmpty()) {
+		uint64_t deadline = m_deadlines.Top()->deadline;
+		target = deadline > m_spinNs ? deadline - m_spinNs : 0;
+		// 0 would disarm, a time in the past fires right away.
+		if (target == 0) target = 1;
+	}
+	if (target == m_armedTime) return;
+	m_armedTime = target;
+
+	struct itimerspec timer_time;
+	memset(&timer_time, 0, sizeof(timer_time));
+	timer_time.it_value.tv_sec = target / NS_PER_SEC;
+	timer_time.it_value.tv_nsec = target % NS_PER_SEC;
+	if (timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &timer_time, NULL) == -1)
+		LOG_ERROR(LOG_TAG, "%s unable to set timer: %s", __func__, strerror(errno));
+}
+
+// Runs on the alarm thread when the timerfd expired.
+void HighResAlarm::timer_ready(void* context) {
+	CHECK(context != NULL);
+	HighResAlarm* thiz = static_cast<HighResAlarm*>(context);
+
+	// Re-arming resets the timerfd, so the readiness may be stale by now.
+	uint64_t expirations = 0;
+	if (read(thiz->m_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return;
+
+	thiz->dispatch_expired();
+}
+
+// Runs on the alarm thread: calls every alarm that is due, busy-waiting
+// for the ones within |m_spinNs|, then re-arms for the rest.
+void HighResAlarm::dispatch_expired(void) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	// The timerfd disarmed itself when it fired.
+	m_armedTime = 0;
+
+	while (!m_deadlines.IsEmpty()) {
+		alarm_data_t *alarm = m_deadlines.Top();
+		uint64_t just_now = Now();
+		if (alarm->deadline > just_now + m_spinNs) break;
+
+		// Spin without the lock, the alarm may be canceled or an earlier
+		// one set meanwhile, so look at the heap again afterwards.
+		if (alarm->deadline > just_now) {
+			uint64_t deadline = alarm->deadline;
+			lock.unlock();
+			while (Now() < deadline) cpu_relax();
+			lock.lock();
+			continue;
+		}
+
+		m_deadlines.Remove(alarm);
+		uint64_t jitter = just_now - alarm->deadline;
+		update_scheduling_stats(&alarm->stats, just_now / 1000, alarm->deadline / 1000);
+		alarm->prev_deadline = alarm->deadline;
+
+		callback_func_t callback = alarm->callback_func;
+		void *data = alarm->data;
+		if (alarm->isPeriodic) {
+			// Stay on the grid of the first deadline. When whole periods
+			// went by, skip them rather than firing in a burst.
+			uint64_t missed = jitter / alarm->period;
+			alarm->stats.missed_periods += missed;
+			alarm->deadline += (missed + 1) * alarm->period;
+			m_deadlines.Push(alarm);
+			++alarm->stats.rescheduled_count;
+		} else {
+			alarm->deadline = 0;
+			alarm->callback_func = NULL;
+			alarm->data = NULL;
+		}
+
+		// Same as Alarm: the callback may cancel or free its own alarm.
+		callback_begin(alarm);
+		lock.unlock();
+		callback(data);
+		callback_end(alarm);
+		lock.lock();
+	}
+
+	arm();
+}
+
+void HighResAlarm::Dump(int fd) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	uint64_t just_now = Now();
+	dprintf(fd, "\nBluetooth High Resolution Alarms Statistics:\n");
+	dprintf(fd, "  Total Alarms: %zu\n\n", m_timerCount);
+	for (alarm_data_t *alarm = m_timers; alarm != NULL; alarm = alarm->next) {
+		bool scheduled = m_deadlines.Contains(alarm);
+		uint64_t remaining = scheduled && alarm->deadline > just_now ? alarm->deadline - just_now : 0;
+		dump_timer(fd, alarm, scheduled, alarm->period / 1000, remaining / 1000);
+	}
+}
+
+uint64_t HighResAlarm::Now(void) {
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		LOG_ERROR(LOG_TAG, "unable to get current time: %s", strerror(errno));
+		return 0;
+	}
+	return (ts.tv_sec * NS_PER_SEC) + ts.tv_nsec;
+}
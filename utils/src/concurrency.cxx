@@ -19,23 +19,62 @@
 *********************************************************************************/
 #define LOG_TAG "utils_concurrency"
 
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
 #include "concurrency.h"
 
+// Upper bound of the adaptive spin before a waiter sleeps in the kernel.
+static const int kMaxSpin = 200;
+
+// Spinning only pays off if the signaler can run at the same time.
+static const bool kCanSpin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static void deadline_after(uint64_t timeout_ms, struct timespec *deadline) {
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout_ms / 1000;
+	deadline->tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec += 1;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+int futex_wait(std::atomic<int> *addr, int expected, const struct timespec *deadline) {
+	// FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline.
+	return syscall(SYS_futex, reinterpret_cast<int *>(addr),
+		FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, expected, deadline,
+		NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+int futex_wake(std::atomic<int> *addr, int count) {
+	return syscall(SYS_futex, reinterpret_cast<int *>(addr),
+		FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+}
+
 Mutex::Mutex()
 	:m_mutex() {
 	pthread_mutex_init(&m_mutex, nullptr);
 }
 
 Mutex::~Mutex() {
-	unlock();
 	pthread_mutex_destroy(&m_mutex);
 }
 
 bool Mutex::lock() {
-	if (0 != pthread_mutex_trylock(&m_mutex))
-		pthread_mutex_unlock(&m_mutex);
-
-	return (0 == pthread_mutex_trylock(&m_mutex));
+	return (0 == pthread_mutex_lock(&m_mutex));
 }
 
 bool Mutex::unlock() {
@@ -45,7 +84,13 @@ bool Mutex::unlock() {
 Condition::Condition(Mutex *mutex)
 	:m_cond()
 	,m_mutex(&(mutex->m_mutex)){
-	pthread_cond_init(&m_cond, nullptr);
+	// Timed waits are measured against the monotonic clock, so they are
+	// not disturbed by wall clock changes.
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&m_cond, &attr);
+	pthread_condattr_destroy(&attr);
 }
 
 Condition::~Condition() {
@@ -55,6 +100,14 @@ void Condition::wait() {
 	pthread_cond_wait(&m_cond, m_mutex);
 }
 
+// Returns false if |timeout_ms| elapsed before the condition was signaled.
+bool Condition::wait_for(uint64_t timeout_ms) {
+	struct timespec deadline;
+	deadline_after(timeout_ms, &deadline);
+
+	return (ETIMEDOUT != pthread_cond_timedwait(&m_cond, m_mutex, &deadline));
+}
+
 void Condition::signal() {
 	pthread_cond_signal(&m_cond);
 }
@@ -83,6 +136,25 @@ void ConCurrency::wait() {
 	m_mutex.unlock();
 }
 
+// Returns false, without taking a count, if nobody signaled within
+// |timeout_ms|.
+bool ConCurrency::wait_for(uint64_t timeout_ms) {
+	bool ret = true;
+
+	m_mutex.lock();
+	--m_count;
+	while (m_count < 0) {
+		if (!m_cond.wait_for(timeout_ms) && m_count < 0) {
+			++m_count;
+			ret = false;
+			break;
+		}
+	}
+	m_mutex.unlock();
+
+	return ret;
+}
+
 void ConCurrency::signal() {
 	m_mutex.lock();
 	if (++m_count >= 0) {
@@ -97,4 +169,140 @@ void ConCurrency::broadcast() {
 		m_cond.broadcast();
 	}
 	m_mutex.unlock();
-}
\ No newline at end of file
+}
+
+Semaphore::Semaphore(int count)
+	:m_value(count)
+	,m_spin(kMaxSpin / 4) {
+}
+
+void Semaphore::wait() {
+	acquire(NULL);
+}
+
+// Returns false, without taking a count, if nobody signaled within
+// |timeout_ms|.
+bool Semaphore::wait_for(uint64_t timeout_ms) {
+	struct timespec deadline;
+	deadline_after(timeout_ms, &deadline);
+	return acquire(&deadline);
+}
+
+bool Semaphore::try_wait() {
+	int value = m_value.load(std::memory_order_relaxed);
+	while (value > 0) {
+		if (m_value.compare_exchange_weak(value, value - 1,
+			std::memory_order_acquire, std::memory_order_relaxed))
+			return true;
+	}
+	return false;
+}
+
+void Semaphore::signal() {
+	int value = m_value.load(std::memory_order_relaxed);
+	while (!m_value.compare_exchange_weak(value, value < 0 ? 1 : value + 1,
+		std::memory_order_release, std::memory_order_relaxed)) {
+	}
+
+	// Only -1 says somebody may sleep. The word is not touched again, so
+	// a woken waiter may free the semaphore right away.
+	if (value < 0) futex_wake(&m_value, 1);
+}
+
+// Spins for a count while that recently paid off. The spin length follows
+// how long the last successful spins took.
+bool Semaphore::spin() {
+	if (!kCanSpin) return false;
+
+	int limit = m_spin.load(std::memory_order_relaxed) * 2 + 10;
+	if (limit > kMaxSpin) limit = kMaxSpin;
+	for (int i = 0; i < limit; ++i) {
+		if (try_wait()) {
+			int spin = m_spin.load(std::memory_order_relaxed);
+			m_spin.store(spin + (i - spin) / 8, std::memory_order_relaxed);
+			return true;
+		}
+		cpu_relax();
+	}
+
+	int spin = m_spin.load(std::memory_order_relaxed);
+	m_spin.store(spin - spin / 8 - 1 > 0 ? spin - spin / 8 - 1 : 0,
+		std::memory_order_relaxed);
+	return false;
+}
+
+bool Semaphore::acquire(const struct timespec *deadline) {
+	if (try_wait() || spin()) return true;
+
+	bool slept = false;
+	int value = m_value.load(std::memory_order_relaxed);
+	for (;;) {
+		if (value > 0) {
+			// A waiter that slept can't know whether others still sleep:
+			// keep the -1 mark on the last count, and pass any remaining
+			// count on to the next sleeper.
+			int next = (slept && value == 1) ? -1 : value - 1;
+			if (!m_value.compare_exchange_weak(value, next,
+				std::memory_order_acquire, std::memory_order_relaxed))
+				continue;
+			if (slept && next > 0) futex_wake(&m_value, 1);
+			return true;
+		}
+
+		if (value == 0 && !m_value.compare_exchange_weak(value, -1,
+			std::memory_order_relaxed, std::memory_order_relaxed))
+			continue;
+
+		if (futex_wait(&m_value, -1, deadline) == -1 && errno == ETIMEDOUT)
+			return try_wait();
+		slept = true;
+		value = m_value.load(std::memory_order_relaxed);
+	}
+}
+
+EventFlag::EventFlag(bool set)
+	:m_state(set ? 1 : 0) {
+}
+
+void EventFlag::set() {
+	if (m_state.exchange(1, std::memory_order_release) == 2)
+		futex_wake(&m_state, INT_MAX);
+}
+
+void EventFlag::reset() {
+	int expected = 1;
+	m_state.compare_exchange_strong(expected, 0, std::memory_order_relaxed);
+}
+
+void EventFlag::wait() {
+	wait_until(NULL);
+}
+
+// Returns false if the event was not set within |timeout_ms|.
+bool EventFlag::wait_for(uint64_t timeout_ms) {
+	struct timespec deadline;
+	deadline_after(timeout_ms, &deadline);
+	return wait_until(&deadline);
+}
+
+bool EventFlag::wait_until(const struct timespec *deadline) {
+	if (kCanSpin) {
+		for (int i = 0; i < kMaxSpin; ++i) {
+			if (is_set()) return true;
+			cpu_relax();
+		}
+	}
+
+	int state = m_state.load(std::memory_order_acquire);
+	while (state != 1) {
+		if (state == 0 && !m_state.compare_exchange_weak(state, 2,
+			std::memory_order_acquire, std::memory_order_acquire))
+			continue;
+
+		if (futex_wait(&m_state, 2, deadline) == -1 && errno == ETIMEDOUT)
+			return is_set();
+		state = m_state.load(std::memory_order_acquire);
+	}
+
+	return true;
+}
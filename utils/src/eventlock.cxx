@@ -21,20 +21,29 @@
 #define LOG_TAG "utils_eventlock"
 
 #include <errno.h>
-#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
 
 #include "utils.h"
+#include "concurrency.h"
 #include "eventlock.h"
 
 #ifndef EFD_SEMAPHORE
 #define EFD_SEMAPHORE (1 << 0)
 #endif
 
+// m_count value once the count has moved into the fd. Keeping it in the
+// same word lets Post() decide with one atomic operation and never touch
+// the lock after publishing, so a waiter may free it right away.
+static const int kExported = INT_MIN;
+
 
 EventLock::EventLock(int value)
-    :m_fd(INVALID_FD)
+    :m_count(0)
+    ,m_fd(INVALID_FD)
 {
     New(value);
 }
@@ -44,37 +53,99 @@ EventLock::~EventLock() {
 }
 
 int EventLock::Wait() {
-    eventfd_t value;
-	return eventfd_read(m_fd, &value);    
+    bool slept = false;
+    int count = m_count.load(std::memory_order_relaxed);
+    for (;;) {
+        if (count > 0) {
+            // Same hand-over as Semaphore: a waiter that slept keeps the
+            // sleeper mark on the last count and passes any rest on.
+            int next = (slept && count == 1) ? -1 : count - 1;
+            if (!m_count.compare_exchange_weak(count, next,
+                std::memory_order_acquire, std::memory_order_relaxed))
+                continue;
+            if (slept && next > 0) futex_wake(&m_count, 1);
+            return 0;
+        }
+
+        if (count == kExported) return WaitFd();
+
+        if (count == 0 && !m_count.compare_exchange_weak(count, -1,
+            std::memory_order_relaxed, std::memory_order_relaxed))
+            continue;
+
+        // GetFd() swaps the word before waking everybody, so this can't
+        // sleep through the export.
+        futex_wait(&m_count, -1, NULL);
+        slept = true;
+        count = m_count.load(std::memory_order_relaxed);
+    }
 }
 
 bool EventLock::TryWait() {
-    int flags = fcntl(m_fd, F_GETFL);
-    if (-1 == flags) {
-        LOG_ERROR(LOG_TAG, "unable to get flags for event fd: %s", strerror(errno));
-        return false;
-    }
-    if (fcntl(m_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        LOG_ERROR(LOG_TAG, "unable to set O_NONBLOCK for event fd: %s", strerror(errno));
-        return false;
-    }
-    bool ret = true;
+    if (TakeCount()) return true;
+    if (m_count.load(std::memory_order_acquire) != kExported) return false;
+
     eventfd_t value;
-    if (eventfd_read(m_fd, &value) == -1) ret = false;
+    return eventfd_read(m_fd, &value) == 0;
+}
+
+int EventLock::Post() {
+    int count = m_count.load(std::memory_order_acquire);
+    do {
+        if (count == kExported)
+            return eventfd_write(m_fd, 1ULL);
+    } while (!m_count.compare_exchange_weak(count, count < 0 ? 1 : count + 1,
+        std::memory_order_release, std::memory_order_acquire));
+
+    if (count < 0) futex_wake(&m_count, 1);
+    return 0;
+}
 
-    if (fcntl(m_fd, F_SETFL, flags) == -1)
-		LOG_ERROR(LOG_TAG, "%s unable to restore flags for event fd: %s", strerror(errno));
+int EventLock::GetFd() {
+    if (m_count.load(std::memory_order_acquire) == kExported) return m_fd;
 
-    return ret;  
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd == INVALID_FD) {
+        m_fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK);
+        if (m_fd == INVALID_FD) {
+            LOG_ERROR(LOG_TAG, "unable to create event fd: %s", strerror(errno));
+            return INVALID_FD;
+        }
+        // Hand the count to the fd and kick every futex sleeper over to it.
+        int count = m_count.exchange(kExported, std::memory_order_acq_rel);
+        if (count > 0) eventfd_write(m_fd, count);
+        futex_wake(&m_count, INT_MAX);
+    }
+
+    return m_fd;
 }
 
-int EventLock::Post() {
-	return eventfd_write(m_fd, 1ULL);   
+bool EventLock::TakeCount() {
+    int count = m_count.load(std::memory_order_relaxed);
+    while (count > 0) {
+        if (m_count.compare_exchange_weak(count, count - 1,
+            std::memory_order_acquire, std::memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+// The exported fd never blocks, so sleep in poll() and retry the read when
+// another reader got there first.
+int EventLock::WaitFd() {
+    eventfd_t value;
+    struct pollfd pfd = { m_fd, POLLIN, 0 };
+    for (;;) {
+        if (TakeCount() || eventfd_read(m_fd, &value) == 0) return 0;
+        if (errno != EAGAIN) return -1;
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) return -1;
+    }
 }
 
 void EventLock::New(int value) {
     CHECK(m_fd == INVALID_FD);
-    m_fd = eventfd(value, EFD_SEMAPHORE);
+    CHECK(value >= 0 && value <= EVENTLOCK_VALUE_MAX);
+    m_count = value;
 }
 
 void EventLock::Free() {
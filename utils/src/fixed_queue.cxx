@@ -136,7 +136,7 @@ int FixedQueue::GetEnqueueFd() {
 void FixedQueue::New(size_t capacity) {
     m_capacity = capacity;
     m_list = new SeqList(NULL);
-    m_enqueue_evt = new EventLock(capacity);
+    m_enqueue_evt = new EventLock(capacity > EVENTLOCK_VALUE_MAX ? EVENTLOCK_VALUE_MAX : (int)capacity);
     m_dequeue_evt = new EventLock(0);
     
     CHECK(m_list != NULL);
@@ -19,48 +19,236 @@
 *********************************************************************************/ 
 #define LOG_TAG "bluegenius_utils_future"
 
+#include <vector>
+
 #include "utils.h"
-#include "eventlock.h"
+#include "concurrency.h"
+#include "thread.h"
 #include "future.h"
 
+Future::continuation_t* const Future::kReady = reinterpret_cast<Future::continuation_t*>(1);
+
+// State shared by the continuations of one WhenAll() or WhenAny().
+typedef struct when_t when_t;
+
+typedef struct {
+	when_t *when;
+	size_t index;
+}when_entry_t;
+
+struct when_t {
+	std::atomic<size_t> pending;	//futures whose continuation hasn't run yet
+	std::atomic<bool> fired;	//WhenAny only, set by the first one ready
+	Future *combined;
+	void **results;
+	std::vector<Future*> inputs;
+	std::vector<when_entry_t> entries;
+};
+
+static when_t* new_when(Future **futures, size_t count, void **results) {
+	when_t *when = new when_t();
+	when->pending = count;
+	when->fired = false;
+	when->combined = new Future();
+	when->results = results;
+	when->inputs.assign(futures, futures + count);
+	when->entries.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		when->entries[i].when = when;
+		when->entries[i].index = i;
+	}
+	return when;
+}
+
+static void when_all_ready(void *context, void *result) {
+	when_entry_t *entry = static_cast<when_entry_t*>(context);
+	when_t *when = entry->when;
+
+	if (when->results != NULL)
+		when->results[entry->index] = result;
+	if (when->pending.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+	// The last one: every result is in place.
+	Future *combined = when->combined;
+	void **results = when->results;
+	delete when;
+	combined->Ready(results);
+}
+
+static void when_any_ready(void *context, void *result) {
+	when_entry_t *entry = static_cast<when_entry_t*>(context);
+	when_t *when = entry->when;
+	(void)result;
+
+	if (!when->fired.exchange(true, std::memory_order_acq_rel))
+		when->combined->Ready(when->inputs[entry->index]);
+
+	// The others still hold |when| until their futures are ready.
+	if (when->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete when;
+}
+
 Future::Future(void *value)
 	:m_ready(false)
 	,m_result(NULL)
-	,m_event(NULL)
+	,m_continuations(NULL)
+	,m_event(false)
 {
 	New(value);
 }
 
 Future::~Future() {
 	Free();
+
+	// Continuations of a future that never became ready never run.
+	continuation_t *continuation = m_continuations.load(std::memory_order_acquire);
+	while (continuation != NULL && continuation != kReady) {
+		continuation_t *next = continuation->next;
+		if (continuation->owned)
+			delete continuation;
+		continuation = next;
+	}
 }
 
 void Future::Ready(void *value) {
-	CHECK(m_event != NULL);
 	CHECK(m_ready != false);
 	m_result = value;
-	m_event->Post();
+
+	continuation_t *pending = m_continuations.exchange(kReady, std::memory_order_acq_rel);
+	// Last touch of the future: a waiter may delete it as soon as it sees
+	// the event, the continuations below only use the list taken above.
+	m_event.set();
+
+	// The list was built newest first, run them in the order they came.
+	continuation_t *ordered = NULL;
+	while (pending != NULL) {
+		continuation_t *next = pending->next;
+		pending->next = ordered;
+		ordered = pending;
+		pending = next;
+	}
+	while (ordered != NULL) {
+		continuation_t *next = ordered->next;
+		run_continuation(ordered, value);
+		ordered = next;
+	}
 }
 
 void* Future::Await() {
-	if (m_event != NULL)
-		m_event->Wait();
+	// Always through the event, kReady is published before Ready() is done
+	// with the future.
+	if (m_ready)
+		m_event.wait();
 
 	void *result = m_result;
 	Free();
 	return result;
 }
 
+bool Future::IsReady() {
+	return m_event.is_set();
+}
+
+// Only meaningful once IsReady().
+void* Future::GetResult() {
+	CHECK(IsReady());
+	return m_result;
+}
+
+// Calls |func|(|context|, result) once the future is ready: posted to
+// |thread|, or right on the thread that makes it ready when |thread| is
+// NULL. Runs straight away if the future is ready already.
+void Future::Then(Thread *thread, thread_fn func, void *context) {
+	CHECK(func != NULL);
+
+	continuation_t *continuation = new continuation_t();
+	continuation->thread = thread;
+	continuation->func = func;
+	continuation->context = context;
+	continuation->owned = true;
+	add_continuation(continuation);
+}
+
+// Same as above without allocating: |continuation| is the caller's, and
+// must stay alive until |func| is called. A co_await keeps it in the
+// awaiter, in the coroutine frame.
+void Future::Then(continuation_t *continuation, Thread *thread, thread_fn func, void *context) {
+	CHECK(continuation != NULL);
+	CHECK(func != NULL);
+
+	continuation->thread = thread;
+	continuation->func = func;
+	continuation->context = context;
+	continuation->owned = false;
+	add_continuation(continuation);
+}
+
+void Future::add_continuation(continuation_t *continuation) {
+	continuation_t *head = m_continuations.load(std::memory_order_acquire);
+	do {
+		if (head == kReady) {
+			run_continuation(continuation, m_result);
+			return;
+		}
+		continuation->next = head;
+	} while (!m_continuations.compare_exchange_weak(head, continuation,
+		std::memory_order_acq_rel, std::memory_order_acquire));
+}
+
+// Returns a new future, ready once all |futures| are, with the results
+// stored in |results| (if not NULL) in the same order. Its own result is
+// |results|. The caller deletes it.
+Future* Future::WhenAll(Future **futures, size_t count, void **results) {
+	CHECK(futures != NULL || count == 0);
+
+	if (count == 0) {
+		Future *combined = new Future();
+		combined->Ready(results);
+		return combined;
+	}
+
+	when_t *when = new_when(futures, count, results);
+	Future *combined = when->combined;
+	for (size_t i = 0; i < count; i++)
+		futures[i]->Then(NULL, when_all_ready, &when->entries[i]);
+	return combined;
+}
+
+// Returns a new future, ready as soon as one of |futures| is, with that
+// future as its result. The caller deletes it, but |futures| have to stay
+// alive until all of them are ready.
+Future* Future::WhenAny(Future **futures, size_t count) {
+	CHECK(futures != NULL && count > 0);
+
+	when_t *when = new_when(futures, count, NULL);
+	Future *combined = when->combined;
+	for (size_t i = 0; i < count; i++)
+		futures[i]->Then(NULL, when_any_ready, &when->entries[i]);
+	return combined;
+}
+
+// A caller's continuation may be gone as soon as its function runs, so
+// it is read in full first.
+void Future::run_continuation(continuation_t *continuation, void *result) {
+	Thread *thread = continuation->thread;
+	thread_fn func = continuation->func;
+	void *context = continuation->context;
+	if (continuation->owned)
+		delete continuation;
+
+	if (thread != NULL)
+		thread->Post(func, context, result);
+	else
+		func(context, result);
+}
+
 void Future::New(void *value) {
-	m_event = new EventLock(0);
+	m_event.reset();
+	m_continuations.store(NULL, std::memory_order_relaxed);
 	m_ready = true;
 	m_result = value;
 }
 
 void Future::Free() {
-	if (m_event != NULL)
-		delete m_event;
 	m_ready = false;
 }
-
-
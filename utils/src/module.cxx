@@ -19,11 +19,129 @@
 *********************************************************************************/
 #define LOG_TAG "utils_module" 
 #include <dlfcn.h>
+#include <string.h>
+#include <atomic>
+#include <string>
 
 #include "utils.h"
+#include "concurrency.h"
+#include "threadpool.h"
 #include "future.h"
 #include "module.h"
 
+// Most modules a graph runs at the same time.
+static const size_t MAX_PARALLEL_MODULES = 8;
+
+typedef struct {
+	ModuleManager *manager;
+	ThreadPool *pool;
+	bool shutting_down;
+	std::atomic<size_t> remaining;	//modules not done yet
+	std::atomic<bool> failed;
+	Semaphore done;
+}module_graph_t;
+
+/**
+ * \brief One module of a startup or shutdown graph
+ *
+ * Runs on the graph's pool once every module it waits for is done. A
+ * module finishing, right away or when its Future is ready, submits the
+ * ones waiting for it in turn.
+ */
+class ModuleTask : public Task {
+public:
+	ModuleTask(const ModuleManager::module_t *module)
+		:m_module(module)
+		,m_graph(NULL)
+		,m_waiting(0)
+		,m_blocked(false)
+		,m_invoked(false) {}
+
+	virtual void run();
+	void finish(bool success);
+
+	static void future_ready(void *context, void *result);
+
+	const ModuleManager::module_t *m_module;
+	module_graph_t *m_graph;
+	std::vector<ModuleTask*> m_next;	//modules waiting for this one
+	std::atomic<size_t> m_waiting;	//modules this one still waits for
+	std::atomic<bool> m_blocked;	//a module it waits for failed to start
+	bool m_invoked;	//the lifecycle step ran, rather than being skipped
+};
+
+void ModuleTask::run() {
+	ModuleManager *manager = m_graph->manager;
+	ModuleManager::module_state_t state = manager->get_module_state(m_module);
+	ModuleManager::module_lifecycle_fn fun;
+
+	if (m_graph->shutting_down) {
+		CHECK(state <= ModuleManager::MODULE_STATE_STARTED);
+		// Only something to do if the module was actually started
+		if (state < ModuleManager::MODULE_STATE_STARTED) {
+			finish(true);
+			return;
+		}
+		LOG_TRACE(LOG_TAG, "Shutdown module %s", m_module->name);
+		fun = m_module->shut_down;
+	} else {
+		if (m_blocked) {
+			LOG_ERROR(LOG_TAG, "not starting module %s, a dependency failed", m_module->name);
+			finish(false);
+			return;
+		}
+		if (state == ModuleManager::MODULE_STATE_STARTED) {
+			finish(true);
+			return;
+		}
+		CHECK(state == ModuleManager::MODULE_STATE_INITIALIZED || m_module->init == NULL);
+		LOG_TRACE(LOG_TAG, "Startup module %s", m_module->name);
+		fun = m_module->start_up;
+	}
+
+	// Same contract as invoke_lifecycle_function(), but the Future is
+	// chained rather than awaited so no pool thread is parked on it.
+	m_invoked = true;
+	Future *future = fun != NULL ? fun() : NULL;
+	if (future == NULL)
+		finish(true);
+	else
+		future->Then(NULL, future_ready, this);
+}
+
+void ModuleTask::future_ready(void *context, void *result) {
+	static_cast<ModuleTask*>(context)->finish(result != NULL);
+}
+
+// Runs once per module, on the pool or on the thread that readied its
+// Future. The last one wakes the caller, nothing may be touched after.
+void ModuleTask::finish(bool success) {
+	module_graph_t *graph = m_graph;
+
+	if (success && m_invoked) {
+		graph->manager->set_module_state(m_module, graph->shutting_down ?
+			ModuleManager::MODULE_STATE_INITIALIZED : ModuleManager::MODULE_STATE_STARTED);
+	} else if (!success) {
+		if (m_invoked)
+			LOG_ERROR(LOG_TAG, "failed to %s module %s",
+				graph->shutting_down ? "shutdown" : "startup", m_module->name);
+		graph->failed = true;
+	}
+
+	for (size_t i = 0; i < m_next.size(); i++) {
+		ModuleTask *next = m_next[i];
+		// A failed shutdown doesn't hold back the rest, a failed startup
+		// keeps everything that depends on it down.
+		if (!success && !graph->shutting_down)
+			next->m_blocked = true;
+		if (next->m_waiting.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			graph->pool->submit(next);
+	}
+
+	if (graph->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		graph->done.signal();
+}
+
 ModuleManager ModuleManager::m_instance;
 
 ModuleManager::ModuleManager() {
@@ -98,6 +216,134 @@ void ModuleManager::module_clean_up(const module_t* module) {
 	set_module_state(module, MODULE_STATE_NONE);
 }
 
+// Starts |modules| and everything they depend on. Modules whose
+// dependencies are all up start at the same time, and their Futures are
+// waited for together, so startup takes as long as the longest chain of
+// dependencies rather than the sum of all modules. Returns false if a
+// dependency is missing or cyclic, or if any module failed to start; the
+// modules depending on a failed one are not started.
+bool ModuleManager::module_start_up_all(const module_t* const* modules, size_t count) {
+	std::vector<ModuleTask*> nodes;
+	bool success = build_graph(modules, count, false, nodes) && run_graph(nodes, false);
+
+	for (size_t i = 0; i < nodes.size(); i++)
+		delete nodes[i];
+	return success;
+}
+
+// Shuts |modules| down in reverse dependency order: a module only goes
+// once every module among |modules| that depends on it is down. Modules
+// that don't depend on each other shut down at the same time. Returns
+// false, with nothing shut down, if |modules| depend on each other in a
+// cycle.
+bool ModuleManager::module_shut_down_all(const module_t* const* modules, size_t count) {
+	std::vector<ModuleTask*> nodes;
+	bool success = build_graph(modules, count, true, nodes) && run_graph(nodes, true);
+
+	for (size_t i = 0; i < nodes.size(); i++)
+		delete nodes[i];
+	return success;
+}
+
+// Builds one node per module with its edges: dependency to dependent for
+// startup, the other way around when |reverse|. Startup takes in the
+// dependencies of |modules| as well, looked up by name among |modules|
+// first and then by symbol. Shutdown only orders |modules| among
+// themselves and skips any other dependency. Fails on a missing
+// dependency or a cycle.
+bool ModuleManager::build_graph(const module_t* const* modules, size_t count, bool reverse,
+	std::vector<ModuleTask*> &nodes) {
+	std::map<const module_t*, ModuleTask*> index;
+	std::map<std::string, const module_t*> by_name;
+	for (size_t i = 0; i < count; i++) {
+		CHECK(modules[i] != NULL);
+		by_name[modules[i]->name] = modules[i];
+		if (index.find(modules[i]) == index.end()) {
+			index[modules[i]] = new ModuleTask(modules[i]);
+			nodes.push_back(index[modules[i]]);
+		}
+	}
+
+	// |nodes| grows as dependencies are found, so this walks them too.
+	for (size_t i = 0; i < nodes.size(); i++) {
+		const module_t *module = nodes[i]->m_module;
+		for (size_t d = 0; d < MAX_MODULE_DEPENDENCIES && module->dependencies[d] != NULL; d++) {
+			const char *name = module->dependencies[d];
+			std::map<std::string, const module_t*>::iterator found = by_name.find(name);
+			// Shutdown leaves alone what it wasn't asked to stop.
+			if (reverse && found == by_name.end()) continue;
+			const module_t *dependency = found != by_name.end() ? found->second : get_module(name);
+			if (dependency == NULL) {
+				LOG_ERROR(LOG_TAG, "module %s depends on unknown module %s", module->name, name);
+				return false;
+			}
+
+			if (index.find(dependency) == index.end()) {
+				index[dependency] = new ModuleTask(dependency);
+				nodes.push_back(index[dependency]);
+			}
+
+			ModuleTask *from = index[dependency];
+			ModuleTask *to = nodes[i];
+			if (reverse) std::swap(from, to);
+			from->m_next.push_back(to);
+			to->m_waiting++;
+		}
+	}
+
+	// Kahn's algorithm: whatever can't be reached from the nodes without
+	// incoming edges sits on a cycle.
+	std::map<ModuleTask*, size_t> waiting;
+	std::vector<ModuleTask*> ready;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		waiting[nodes[i]] = nodes[i]->m_waiting;
+		if (nodes[i]->m_waiting == 0) ready.push_back(nodes[i]);
+	}
+	size_t ordered = 0;
+	while (!ready.empty()) {
+		ModuleTask *node = ready.back();
+		ready.pop_back();
+		ordered++;
+		for (size_t i = 0; i < node->m_next.size(); i++)
+			if (--waiting[node->m_next[i]] == 0) ready.push_back(node->m_next[i]);
+	}
+	if (ordered != nodes.size()) {
+		for (size_t i = 0; i < nodes.size(); i++)
+			if (waiting[nodes[i]] != 0)
+				LOG_ERROR(LOG_TAG, "module %s is part of a dependency cycle", nodes[i]->m_module->name);
+		return false;
+	}
+
+	return true;
+}
+
+// Submits the nodes that wait for nothing, and blocks until every node is
+// done. Returns false if any of them failed.
+bool ModuleManager::run_graph(std::vector<ModuleTask*> &nodes, bool shutting_down) {
+	if (nodes.empty()) return true;
+
+	size_t width = nodes.size() < MAX_PARALLEL_MODULES ? nodes.size() : MAX_PARALLEL_MODULES;
+	ThreadPool pool(static_cast<int>(width), static_cast<int>(width));
+
+	module_graph_t graph;
+	graph.manager = this;
+	graph.pool = &pool;
+	graph.shutting_down = shutting_down;
+	graph.remaining = nodes.size();
+	graph.failed = false;
+
+	std::vector<ModuleTask*> roots;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		nodes[i]->m_graph = &graph;
+		if (nodes[i]->m_waiting == 0) roots.push_back(nodes[i]);
+	}
+	for (size_t i = 0; i < roots.size(); i++)
+		pool.submit(roots[i]);
+
+	graph.done.wait();
+	return !graph.failed;
+}
+
 const ModuleManager::module_t * ModuleManager::get_module(const char* name) {
 	module_t* module = (module_t*)dlsym(RTLD_DEFAULT, name);
 	return module;
@@ -0,0 +1,212 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+#define LOG_TAG "utils_placement"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "placement.h"
+
+const char* ThreadPlacement::kConfigEnv = "BLUEGENIUS_THREAD_PLACEMENT";
+
+ThreadPlacement& ThreadPlacement::GetInstance() {
+	static ThreadPlacement instance;
+	return instance;
+}
+
+ThreadPlacement::ThreadPlacement()
+	:m_isolate(false) {
+	CPU_ZERO(&m_reserved);
+
+	const char* config = getenv(kConfigEnv);
+	if (config != NULL && !LoadConfig(config))
+		LOG_ERROR(LOG_TAG, "invalid placement config \"%s\"", config);
+}
+
+bool ThreadPlacement::LoadConfig(const char* config) {
+	CHECK(config != NULL);
+
+	std::string text(config);
+	size_t pos = 0;
+	bool ret = true;
+
+	while (pos <= text.size()) {
+		size_t end = text.find(';', pos);
+		if (end == std::string::npos) end = text.size();
+		std::string rule = text.substr(pos, end - pos);
+		pos = end + 1;
+
+		if (rule.empty()) continue;
+		if (rule == "isolate") {
+			SetIsolation(true);
+			continue;
+		}
+
+		size_t eq = rule.find('=');
+		cpu_set_t cpus;
+		if (eq == std::string::npos ||
+			!parse_cpu_list(rule.c_str() + eq + 1, &cpus)) {
+			LOG_ERROR(LOG_TAG, "malformed placement rule \"%s\"", rule.c_str());
+			ret = false;
+			continue;
+		}
+
+		std::string names = rule.substr(0, eq);
+		size_t npos = 0;
+		while (npos <= names.size()) {
+			size_t nend = names.find(',', npos);
+			if (nend == std::string::npos) nend = names.size();
+			std::string name = names.substr(npos, nend - npos);
+			npos = nend + 1;
+			if (!name.empty()) AddRule(name.c_str(), &cpus);
+		}
+	}
+
+	return ret;
+}
+
+bool ThreadPlacement::AddRule(const char* name, const cpu_set_t* cpus) {
+	CHECK(name != NULL && cpus != NULL);
+	if (CPU_COUNT(cpus) == 0) return false;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// PR_SET_NAME truncates thread names to 15 characters, match on that.
+	m_rules[std::string(name, strnlen(name, 15))] = *cpus;
+	update_reserved();
+	return true;
+}
+
+void ThreadPlacement::RemoveRule(const char* name) {
+	CHECK(name != NULL);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_rules.erase(std::string(name, strnlen(name, 15)));
+	update_reserved();
+}
+
+void ThreadPlacement::SetIsolation(bool isolate) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_isolate = isolate;
+}
+
+// Applies the placement rule for |name| to thread |tid| (0 is the calling
+// thread). Returns false only if a rule exists and could not be applied.
+bool ThreadPlacement::Apply(pid_t tid, const char* name) {
+	CHECK(name != NULL);
+
+	cpu_set_t cpus;
+	bool pinned = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_rules.find(std::string(name, strnlen(name, 15)));
+		if (it != m_rules.end()) {
+			cpus = it->second;
+			pinned = true;
+		}
+		else if (m_isolate && CPU_COUNT(&m_reserved) > 0) {
+			if (sched_getaffinity(tid, sizeof(cpus), &cpus) != 0)
+				return true;
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+				if (CPU_ISSET(cpu, &m_reserved)) CPU_CLR(cpu, &cpus);
+			}
+			// Never leave a thread without a cpu to run on.
+			if (CPU_COUNT(&cpus) == 0) return true;
+		}
+		else {
+			return true;
+		}
+	}
+
+	if (sched_setaffinity(tid, sizeof(cpus), &cpus) != 0) {
+		LOG_ERROR(LOG_TAG, "unable to set affinity for thread %s: %s",
+			name, strerror(errno));
+		return !pinned;
+	}
+
+	if (pinned)
+		LOG_TRACE(LOG_TAG, "thread %s pinned to %d cpu(s) on numa node %d",
+			name, CPU_COUNT(&cpus), GetNumaNode(&cpus));
+
+	return true;
+}
+
+// Returns the numa node shared by every cpu in |cpus|, or -1 if they span
+// several nodes or the topology is not exported by sysfs.
+int ThreadPlacement::GetNumaNode(const cpu_set_t* cpus) {
+	CHECK(cpus != NULL);
+
+	int node = -1;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, cpus)) continue;
+
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+		DIR* dir = opendir(path);
+		if (dir == NULL) return -1;
+
+		int cpu_node = -1;
+		struct dirent* entry;
+		while ((entry = readdir(dir)) != NULL) {
+			if (sscanf(entry->d_name, "node%d", &cpu_node) == 1) break;
+		}
+		closedir(dir);
+
+		if (cpu_node == -1 || (node != -1 && node != cpu_node)) return -1;
+		node = cpu_node;
+	}
+
+	return node;
+}
+
+bool ThreadPlacement::parse_cpu_list(const char* list, cpu_set_t* cpus) {
+	CPU_ZERO(cpus);
+
+	const char* p = list;
+	while (*p != '\0') {
+		char* end;
+		long first = strtol(p, &end, 10);
+		if (end == p || first < 0 || first >= CPU_SETSIZE) return false;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first || last >= CPU_SETSIZE) return false;
+			p = end;
+		}
+		for (long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, cpus);
+
+		if (*p == ',') ++p;
+		else if (*p != '\0') return false;
+	}
+
+	return CPU_COUNT(cpus) > 0;
+}
+
+void ThreadPlacement::update_reserved() {
+	CPU_ZERO(&m_reserved);
+	for (auto &rule : m_rules)
+		CPU_OR(&m_reserved, &m_reserved, &rule.second);
+}
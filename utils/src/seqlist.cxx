@@ -67,16 +67,18 @@ void* SeqList::Last() {
 bool SeqList::Remove(void* data) {
     std::lock_guard<std::mutex> lock(*m_mutex);
     
-    list_node_t *Prev = m_pHead, *Next = m_pHead;   
+    list_node_t *Prev = NULL, *Next = m_pHead;   
     while (Next != NULL) {
         if (Next->data == data) {
-            Prev->next = FreeNode(Next);
-            if (Next == m_pHead) {
-                m_pHead = Prev->next;
-            }
             if (Next == m_pTail) {
                 m_pTail = Prev;
             }
+            if (Next == m_pHead) {
+                m_pHead = FreeNode(Next);
+            }
+            else {
+                Prev->next = FreeNode(Next);
+            }
             return true;
         }
         Prev = Next;
@@ -101,6 +103,8 @@ bool SeqList::Append(void* data) {
         m_pTail = node;
     }
     m_length++;
+
+    return true;
 }
 
 void SeqList::Clear() {
@@ -159,6 +163,7 @@ list_node_t* SeqList::FreeNode(list_node_t* node) {
     
     list_node_t* next = node->next;
     if (m_pfnFree) m_pfnFree(node->data);
+    sys_free(node);
     m_length--;
     
     return next;
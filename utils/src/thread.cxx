@@ -24,7 +24,10 @@
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
 
 #include "utils.h"
 #include "eventlock.h"
@@ -32,12 +35,14 @@
 #include "reactor.h"
 #include "fixed_queue.h"
 #include "allocator.h"
+#include "placement.h"
 #include "thread.h"
 #include "eventbus.h"
 
 struct entry_arg {
 	Thread* thread;
 	EventLock* entry_evt;
+	size_t size;
 	int error;
 };
 
@@ -47,12 +52,30 @@ typedef struct {
 	void* arg;
 } work_item_t;
 
+struct thread_timer_t {
+	thread_fn func;
+	void* context;
+	void* arg;
+	uint64_t deadline;	//CLOCK_BOOTTIME, ns
+	uint64_t period;	//ns, 0 for one-shot
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
 Thread::Thread(const char* name, size_t size)
     :m_isjoined(false)
     ,m_thread(NULL)
     ,m_tid(-1)
     ,m_reactor(NULL)
     ,m_workqueue(NULL)
+    ,m_overflow(NULL)
+    ,m_timerfd(INVALID_FD)
+    ,m_nextTimer(THREAD_TIMER_INVALID)
+    ,m_firingTimer(THREAD_TIMER_INVALID)
 {       
     New(name, size);
 }
@@ -65,19 +88,57 @@ void Thread::Post(thread_fn func, void* context, void* arg) {
     CHECK(func != NULL);
     CHECK(m_workqueue != NULL);
     
-    // TODO(sharvil): if the current thread == |thread| and we've run out
-    // of queue space, we should abort this operation, otherwise we'll
-    // deadlock.
-
     // Queue item is freed either when the queue itself is destroyed
     // or when the item is removed from the queue for dispatch.
     work_item_t* item = (work_item_t*)sys_malloc(sizeof(work_item_t));
     item->func = func;
     item->context = context;
 	item->arg = arg;
+
+    // A thread posting to itself must never block on its own full queue,
+    // nobody else would ever drain it. Park the item on the local overflow
+    // list instead, it is dispatched ahead of the shared queue.
+    if (IsSelf()) {
+        if (!m_workqueue->TryEnqueue(item))
+            m_overflow->Append(item);
+        return;
+    }
+
     m_workqueue->Enqueue(item); 
 }
 
+thread_timer_id_t Thread::PostDelayed(thread_fn func, void* context, void* arg, uint64_t delay_ms) {
+    return AddTimer(func, context, arg, delay_ms, 0);
+}
+
+thread_timer_id_t Thread::PostPeriodic(thread_fn func, void* context, void* arg, uint64_t period_ms) {
+    CHECK(period_ms > 0);
+    return AddTimer(func, context, arg, period_ms, period_ms);
+}
+
+// Cancels a delayed or periodic post. Safe to call from any thread; returns
+// false if |timer| already fired (one-shot) or was cancelled before. A
+// callback that is running when Cancel is called is not waited for.
+bool Thread::Cancel(thread_timer_id_t timer) {
+    std::lock_guard<std::mutex> lock(m_timerMutex);
+
+    auto it = m_timers.find(timer);
+    if (it == m_timers.end()) return false;
+
+    thread_timer_t* item = it->second;
+    m_timers.erase(it);
+    // A periodic item that is firing right now is freed by TimerReady once
+    // its callback returns.
+    if (timer == m_firingTimer) return true;
+
+    bool earliest = (m_timerQueue.begin()->second == timer);
+    m_timerQueue.erase(std::make_pair(item->deadline, timer));
+    sys_free(item);
+    if (earliest) ArmTimer();
+
+    return true;
+}
+
 void Thread::Stop() {
     //stop reactor
     if (m_reactor != NULL) m_reactor->Stop();
@@ -95,14 +156,18 @@ void Thread::New(const char* name, size_t size) {
     
     m_reactor = new Reactor();
     if (NULL == m_reactor) goto error;
-    
-    m_workqueue = new FixedQueue(size);
-    if (NULL == m_workqueue) goto error;
+
+    m_timerfd = timerfd_create(CLOCK_BOOTTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (INVALID_FD == m_timerfd) {
+        LOG_ERROR(LOG_TAG, "unable to create timer fd: %s", strerror(errno));
+        goto error;
+    }
     
     // Start is on the stack, but we use a event, so it's safe
 	entry_arg arg;
     arg.thread = this;
     arg.entry_evt = new EventLock(0);
+    arg.size = size;
     arg.error = 0;
     
     pthread_create(&m_thread, NULL, Thread::RunThread, &arg);
@@ -122,6 +187,61 @@ void Thread::Free() {
     Join();
     if (m_reactor) delete m_reactor;
     if (m_workqueue) delete m_workqueue;
+    if (m_overflow) delete m_overflow;
+
+    // Pending delayed posts are dropped with the thread.
+    for (auto &timer : m_timers) {
+        if (timer.first != m_firingTimer) sys_free(timer.second);
+    }
+    m_timers.clear();
+    m_timerQueue.clear();
+    if (INVALID_FD != m_timerfd) {
+        close(m_timerfd);
+        m_timerfd = INVALID_FD;
+    }
+}
+
+thread_timer_id_t Thread::AddTimer(thread_fn func, void* context, void* arg,
+        uint64_t delay_ms, uint64_t period_ms) {
+    CHECK(func != NULL);
+    CHECK(m_timerfd != INVALID_FD);
+
+    thread_timer_t* item = (thread_timer_t*)sys_malloc(sizeof(thread_timer_t));
+    CHECK(item != NULL);
+    item->func = func;
+    item->context = context;
+    item->arg = arg;
+    item->deadline = now_ns() + delay_ms * 1000000ULL;
+    item->period = period_ms * 1000000ULL;
+
+    std::lock_guard<std::mutex> lock(m_timerMutex);
+    thread_timer_id_t id = ++m_nextTimer;
+    m_timers[id] = item;
+    auto it = m_timerQueue.insert(std::make_pair(item->deadline, id)).first;
+
+    // The kernel timer only needs to move when the earliest deadline does.
+    if (it == m_timerQueue.begin()) ArmTimer();
+
+    return id;
+}
+
+// Arms |m_timerfd| for the earliest pending deadline, or disarms it when
+// nothing is pending. Must be called with |m_timerMutex| held.
+void Thread::ArmTimer() {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (!m_timerQueue.empty()) {
+        uint64_t deadline = m_timerQueue.begin()->first;
+        spec.it_value.tv_sec = deadline / 1000000000ULL;
+        spec.it_value.tv_nsec = deadline % 1000000000ULL;
+        // A zero it_value would disarm the timer instead of firing it.
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(m_timerfd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+        LOG_ERROR(LOG_TAG, "unable to arm timer fd for thread %s: %s",
+            m_name, strerror(errno));
 }
 
 bool Thread::SetPriority(int priority) {
@@ -155,6 +275,29 @@ bool Thread::SetRTPriority(int priority) {
     return true;
 }
 
+bool Thread::SetAffinity(int cpu) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return SetAffinity(&cpus);
+}
+
+bool Thread::SetAffinity(const cpu_set_t* cpus) {
+    CHECK(cpus != NULL);
+    if (-1 == m_tid) return false;
+
+    if (sched_setaffinity(m_tid, sizeof(cpu_set_t), cpus) != 0) {
+        LOG_ERROR(LOG_TAG,
+              "unable to set affinity for tid %d, error %s",
+              m_tid, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 bool Thread::IsSelf() {
     CHECK(m_thread != NULL);
     return !!pthread_equal(pthread_self(), m_thread);
@@ -172,26 +315,43 @@ void* Thread::Run(void* arg) {
     
     m_tid = gettid();
 
+    // Place the thread before allocating its queues so that, on numa
+    // systems, they are first touched from the node the thread runs on.
+    ThreadPlacement::GetInstance().Apply(m_tid, m_name);
+
+    m_workqueue = new FixedQueue(entry->size);
+    m_overflow = new SeqList(NULL);
+    if (NULL == m_workqueue || NULL == m_overflow) {
+        LOG_ERROR(LOG_TAG, "unable to allocate work queue for thread %s", m_name);
+        entry->error = ENOMEM;
+        entry->entry_evt->Post();
+        return NULL;
+    }
+
 	LOG_TRACE(LOG_TAG, "thread id %d, thread name %s started", m_tid, m_name);
 
     entry->entry_evt->Post();
     //entry->entry_evt has been free, cannot use it anymore
 
     int fd = m_workqueue->GetDequeueFd(); 
-    void* context = m_workqueue;
+    void* context = this;
 
     reactor_object_t* work_queue_object = m_reactor->Register(fd, context, Thread::WorkqueueReady, NULL);
+    reactor_object_t* timer_object = m_reactor->Register(m_timerfd, context, Thread::TimerReady, NULL);
     m_reactor->Start();
+    m_reactor->Unregister(timer_object);
     m_reactor->Unregister(work_queue_object);
 
     // Make sure we dispatch all queued work items before exiting the thread.
     // This allows a caller to safely tear down by enqueuing a teardown
     // work item and then joining the thread.
+    DrainOverflow();
     size_t count = 0;
     work_item_t* item = static_cast<work_item_t*>(m_workqueue->TryDequeue());
     while (item && count <= m_workqueue->GetCapcity()) {
         item->func(item->context, item->arg);
         sys_free(item);
+        DrainOverflow();
         item = static_cast<work_item_t*>(m_workqueue->TryDequeue());
         ++count;
     }
@@ -211,11 +371,67 @@ void* Thread::RunThread(void* arg) {
     return entry->thread->Run(arg);
 }
 
+// Runs every work item parked on the overflow list. Items are only parked
+// while the shared queue is full, so the list is always empty again before
+// the shared queue can run dry.
+void Thread::DrainOverflow() {
+    while (!m_overflow->IsEmpty()) {
+        work_item_t* item = static_cast<work_item_t*>(m_overflow->Front());
+        m_overflow->Remove(item);
+        item->func(item->context, item->arg);
+        sys_free(item);
+    }
+}
+
 void Thread::WorkqueueReady(void* context) {
   CHECK(context != NULL);
 
-  FixedQueue* queue = (FixedQueue*)context;
-  work_item_t* item = static_cast<work_item_t*>(queue->Dequeue());
+  Thread* thiz = static_cast<Thread*>(context);
+  thiz->DrainOverflow();
+
+  work_item_t* item = static_cast<work_item_t*>(thiz->m_workqueue->Dequeue());
   item->func(item->context, item->arg);
   sys_free(item);
 }
+
+// Fires every delayed or periodic post whose deadline has passed, directly
+// on this thread. Periodic posts are rescheduled from their previous
+// deadline so they don't drift.
+void Thread::TimerReady(void* context) {
+    CHECK(context != NULL);
+
+    Thread* thiz = static_cast<Thread*>(context);
+    uint64_t expirations;
+    if (read(thiz->m_timerfd, &expirations, sizeof(expirations)) == -1 &&
+            errno != EAGAIN)
+        LOG_ERROR(LOG_TAG, "unable to read timer fd: %s", strerror(errno));
+
+    uint64_t now = now_ns();
+    std::unique_lock<std::mutex> lock(thiz->m_timerMutex);
+    while (!thiz->m_timerQueue.empty() && thiz->m_timerQueue.begin()->first <= now) {
+        thread_timer_id_t id = thiz->m_timerQueue.begin()->second;
+        thiz->m_timerQueue.erase(thiz->m_timerQueue.begin());
+
+        thread_timer_t* item = thiz->m_timers[id];
+        if (0 == item->period) thiz->m_timers.erase(id);
+        thiz->m_firingTimer = id;
+
+        lock.unlock();
+        item->func(item->context, item->arg);
+        lock.lock();
+
+        thiz->m_firingTimer = THREAD_TIMER_INVALID;
+        if (item->period != 0 && thiz->m_timers.count(id) != 0) {
+            item->deadline += item->period;
+            // Skip the periods missed while this thread was busy.
+            if (item->deadline <= now)
+                item->deadline += ((now - item->deadline) / item->period + 1) * item->period;
+            thiz->m_timerQueue.insert(std::make_pair(item->deadline, id));
+        }
+        else {
+            sys_free(item);
+        }
+    }
+
+    thiz->ArmTimer();
+}
@@ -21,27 +21,174 @@
 #include <errno.h>
 #include <malloc.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/prctl.h>
+#include <sys/resource.h>
 
-#include <stdexcept>
-
+#include "utils.h"
 #include "concurrency.h"
+#include "placement.h"
 #include "threadpool.h"
 
-const int ThreadPool::kMaxThreadNum = 10;
+thread_local Worker *ThreadPool::ms_current = nullptr;
+
+// Injected tasks are promoted one priority level for every aging period
+// they have been waiting.
+static const uint64_t kDefaultAgingMs = 100;
+// Queued work waiting this long with no idle worker spawns a new worker.
+static const uint64_t kDefaultGrowMs = 10;
+// Workers above the minimum retire after idling this long.
+static const uint64_t kDefaultIdleTimeoutMs = 3000;
+// A worker waiting on a latch with nothing to run yields this many times,
+// then sleeps on the latch, looking for work again every poll period.
+static const int kWaitSpins = 64;
+static const uint64_t kWaitPollMs = 1;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+TaskDeque::TaskDeque()
+	:m_top(0)
+	,m_bottom(0) {
+	for (int64_t i = 0; i < kCapacity; ++i)
+		m_tasks[i].store(nullptr, std::memory_order_relaxed);
+}
+
+bool TaskDeque::push(Task *task) {
+	int64_t b = m_bottom.load(std::memory_order_relaxed);
+	int64_t t = m_top.load(std::memory_order_acquire);
+	if (b - t >= kCapacity) return false;
+
+	m_tasks[b & (kCapacity - 1)].store(task, std::memory_order_relaxed);
+	m_bottom.store(b + 1, std::memory_order_release);
+	return true;
+}
+
+Task *TaskDeque::pop() {
+	int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+	m_bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = m_top.load(std::memory_order_relaxed);
+
+	if (t > b) {
+		//empty
+		m_bottom.store(b + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+
+	Task *task = m_tasks[b & (kCapacity - 1)].load(std::memory_order_relaxed);
+	if (t == b) {
+		//last task, race against thieves for it
+		if (!m_top.compare_exchange_strong(t, t + 1,
+			std::memory_order_seq_cst, std::memory_order_relaxed))
+			task = nullptr;
+		m_bottom.store(b + 1, std::memory_order_relaxed);
+	}
+
+	return task;
+}
+
+Task *TaskDeque::steal() {
+	int64_t t = m_top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t b = m_bottom.load(std::memory_order_acquire);
+	if (t >= b) return nullptr;
+
+	Task *task = m_tasks[t & (kCapacity - 1)].load(std::memory_order_relaxed);
+	if (!m_top.compare_exchange_strong(t, t + 1,
+		std::memory_order_seq_cst, std::memory_order_relaxed))
+		return nullptr;
 
-Worker::Worker()
-	:m_con(1) {
-	Worker(true, false, nullptr);
+	return task;
 }
 
-Worker::Worker(bool suspend, bool detached, const char *name)
-	: m_con(1)
+bool TaskDeque::empty() {
+	int64_t b = m_bottom.load(std::memory_order_acquire);
+	int64_t t = m_top.load(std::memory_order_acquire);
+	return t >= b;
+}
+
+TaskLatch::TaskLatch(size_t count)
+	:m_count(count)
+	,m_event(count == 0) {
+}
+
+// Re-arms a released latch when it goes from zero to |count| again, so it
+// must not be waited on concurrently.
+void TaskLatch::add(size_t count) {
+	if (m_count.fetch_add(count) == 0)
+		m_event.reset();
+}
+
+void TaskLatch::done() {
+	// Setting the event is the last access to the latch, it may be gone as
+	// soon as a waiter sees it released.
+	if (--m_count == 0)
+		m_event.set();
+}
+
+void TaskLatch::wait() {
+	m_event.wait();
+}
+
+// Returns false if the latch was not released within |timeout_ms|.
+bool TaskLatch::wait_for(uint64_t timeout_ms) {
+	return m_event.wait_for(timeout_ms);
+}
+
+// Splits a range in halves while the pool is hungry for work (lazy binary
+// splitting) and runs whatever is left of it.
+class RangeTask : public Task {
+public:
+	RangeTask(ThreadPool *pool, size_t begin, size_t end, size_t grain,
+		const std::function<void(size_t, size_t)> *body, TaskLatch *latch)
+		:Task()
+		,m_pool(pool)
+		,m_begin(begin)
+		,m_end(end)
+		,m_grain(grain)
+		,m_body(body)
+		,m_latch(latch) {}
+
+	virtual void run() {
+		while (m_end - m_begin > m_grain && m_pool->wants_split()) {
+			size_t mid = m_begin + (m_end - m_begin) / 2;
+			m_latch->add();
+			m_pool->submit(new RangeTask(m_pool, mid, m_end, m_grain, m_body, m_latch));
+			m_end = mid;
+		}
+
+		(*m_body)(m_begin, m_end);
+		m_latch->done();
+		delete this;
+	}
+
+private:
+	ThreadPool *m_pool;
+	size_t m_begin;
+	size_t m_end;
+	size_t m_grain;
+	const std::function<void(size_t, size_t)> *m_body;
+	TaskLatch *m_latch;
+};
+
+Worker::Worker(ThreadPool *pool, int index, const char *name)
+	: m_pool(pool)
+	, m_index(index)
+	, m_state(CREATING)
 	, m_tid()
-	, m_detached(detached)
-	, m_state(CREATING) {
+	, m_joinable(false)
+	, m_ktid(-1)
+	, m_level(-1)
+	, m_sem(0) {
+	memset(m_name, 0, sizeof(m_name));
+	strncpy(m_name, name != nullptr ? name : "bt_worker", sizeof(m_name) - 1);
 }
 
 Worker::~Worker() {
@@ -49,80 +196,65 @@ Worker::~Worker() {
 
 void* Worker::main_loop(void *arg) {
 	Worker *thiz = static_cast<Worker *>(arg);
-	bool running = true;
 
-	while (running) {
-		thiz->m_con.wait();
-		switch (thiz->get_state()) {
-		case RUNNING:
-			thiz->run();
-			break;
-		case SUSPENDED:
-			break;
-		case DEAD:
-			running = false;
-			break;
-		}
-	}
+	thiz->m_ktid = gettid();
+	prctl(PR_SET_NAME, (unsigned long)thiz->m_name);
+	ThreadPlacement::GetInstance().Apply(0, thiz->m_name);
+
+	ThreadPool::ms_current = thiz;
+	thiz->run();
+	ThreadPool::ms_current = nullptr;
 
 	return nullptr;
 }
 
+void Worker::run() {
+	while (get_state() != DEAD) {
+		Task *task = m_pool->take(this);
+		if (task != nullptr) {
+			m_pool->account(this, task);
+			task->run();
+			continue;
+		}
+
+		// Never overwrite a DEAD set concurrently by stop().
+		State expected = RUNNING;
+		if (!m_state.compare_exchange_strong(expected, SUSPENDED)) continue;
+		bool retire = !m_pool->park(this);
+		expected = SUSPENDED;
+		m_state.compare_exchange_strong(expected, retire ? DEAD : RUNNING);
+		if (retire) break;
+	}
+}
+
 bool Worker::start() {
 	pthread_attr_t attr;
 	pthread_attr_init(&attr);
-	if (m_detached) {
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	}
-	else {
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-	}
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
+	set_state(RUNNING);
 	int status = pthread_create(&m_tid, &attr, Worker::main_loop,
 		static_cast<void *>(this));
 	pthread_attr_destroy(&attr);
 
+	m_joinable = (0 == status);
+	if (status != 0) set_state(DEAD);
 	return (0 == status);
 }
 
 void Worker::stop() {
 	set_state(DEAD);
-	m_con.signal();
+	m_sem.signal();
 }
 
 bool Worker::join() {
+	if (!m_joinable) return false;
+	m_joinable = false;
 	return (0 == pthread_join(m_tid, NULL));
 }
 
-void Worker::suspend() {
-	set_state(SUSPENDED);
-	m_con.signal();
-}
-
-void Worker::schedule() {
-	set_state(RUNNING);
-	m_con.signal();
-}
-
-void Worker::add_task(int task_id, Task *task) {
-	std::map<int, Task*>::iterator task_it = m_tasks.find(task_id);
-	if (m_tasks.end() == task_it) {
-		m_tasks.insert(std::make_pair(task_id, task));
-	}
-}
-
-void Worker::remove_task(int task_id) {
-	std::map<int, Task*>::iterator task_it = m_tasks.find(task_id);
-	if (m_tasks.end() != task_it) {
-		m_tasks.erase(task_id);
-	}
-}
-
-void Worker::run() {
-	for (auto &item : m_tasks) {
-		if (item.second != nullptr)
-			item.second->run();
-	}
+void Worker::wake() {
+	m_sem.signal();
 }
 
 int Worker::get_priority() {
@@ -140,17 +272,71 @@ void Worker::set_priority(int priority) {
 	pthread_setschedparam(m_tid, policy, static_cast<const struct sched_param*>(&param));
 }
 
-ThreadPool::ThreadPool(int threads)
-	:m_threads()
-	,m_mutex() {
-	if (threads > kMaxThreadNum) {
-		throw std::runtime_error("The initial threads too large");
+bool Worker::set_affinity(int cpu) {
+	if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	return set_affinity(&cpus);
+}
+
+bool Worker::set_affinity(const cpu_set_t *cpus) {
+	CHECK(cpus != nullptr);
+
+	int rc = pthread_setaffinity_np(m_tid, sizeof(cpu_set_t), cpus);
+	if (rc != 0) {
+		LOG_ERROR(LOG_TAG, "unable to set affinity for worker %s: %s",
+			m_name, strerror(rc));
+		return false;
 	}
 
-	for (int i = 0; i < threads; ++i) {
-		Worker *w = new Worker();
-		m_threads.push_back(std::pair<Worker*, bool>(w, false));
-		w->start();
+	return true;
+}
+
+ThreadPool::ThreadPool(int min_threads, int max_threads)
+	:m_workers()
+	,m_resizeMutex()
+	,m_min(min_threads)
+	,m_max(max_threads)
+	,m_stopping(false)
+	,m_active(0)
+	,m_growNs(kDefaultGrowMs * 1000000ULL)
+	,m_idleTimeoutMs(kDefaultIdleTimeoutMs)
+	,m_lastSpawn(0)
+	,m_spawned(0)
+	,m_retired(0)
+	,m_mutex()
+	,m_idleCount(0)
+	,m_agingNs(kDefaultAgingMs * 1000000ULL) {
+	for (int level = 0; level < kPriorityLevels; ++level) {
+		m_injected[level] = 0;
+		m_oldest[level] = 0;
+		m_mapping[level].enabled = false;
+		m_stats[level].count = 0;
+		m_stats[level].total_us = 0;
+		m_stats[level].max_us = 0;
+	}
+
+	if (m_min < 1) m_min = 1;
+	if (m_max <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		m_max = cpus > 0 ? static_cast<int>(cpus) : 1;
+	}
+	if (m_max < m_min) m_max = m_min;
+
+	for (int i = 0; i < m_max; ++i) {
+		// "bt_pool_" leaves 7 chars of the 16 byte thread name for the index.
+		char name[16];
+		snprintf(name, sizeof(name), "bt_pool_%u", static_cast<unsigned>(i) % 10000000u);
+		m_workers.push_back(new Worker(this, i, name));
+	}
+	// Start only once |m_workers| is complete, running workers steal from it.
+	for (int i = 0; i < m_min; ++i) {
+		if (m_workers[i]->start())
+			++m_active;
+		else
+			LOG_ERROR(LOG_TAG, "unable to start worker %s", m_workers[i]->m_name);
 	}
 }
 
@@ -158,65 +344,432 @@ ThreadPool::~ThreadPool() {
 	terminate();
 }
 
-bool ThreadPool::push(Worker* worker) {
-	std::lock_guard<std::mutex> lock(m_mutex);
+void ThreadPool::submit(Task *task) {
+	CHECK(task != nullptr);
+
+	int level = task->get_priority();
+	// |task| may run and be freed as soon as it is queued, don't touch it after.
+	uint64_t now = now_ns();
+	task->m_submitted = now;
+
+	// LOW tasks always go through the injection queue, the only place
+	// aging can see them, or a worker's stream of HIGH work could starve
+	// the LOW ones it queued locally.
+	Worker *worker = ms_current;
+	if (worker == nullptr || worker->m_pool != this || level == Task::LOW ||
+		!worker->m_deques[level].push(task)) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_injection[level].empty())
+			m_oldest[level] = now;
+		m_injection[level].push_back(task);
+		++m_injected[level];
+	}
 
-	if (m_threads.size() >= kMaxThreadNum)
-		return false;
+	// Pairs with the fence in park(): either the parking worker sees this
+	// task, or we see it idle and wake it.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_idleCount.load() > 0)
+		wake_one();
+	else if (oldest_wait(now) >= m_growNs.load())
+		grow(now);
+}
 
-	m_threads.push_back(std::pair<Worker*, bool>(worker, false));
-	return true;
+void ThreadPool::set_elasticity(uint64_t grow_ms, uint64_t idle_timeout_ms) {
+	m_growNs = grow_ms * 1000000ULL;
+	m_idleTimeoutMs = idle_timeout_ms;
 }
 
-Worker* ThreadPool::peek() {
-	std::lock_guard<std::mutex> lock(m_mutex);
+void ThreadPool::set_priority_mapping(Task::Priority priority, int policy, int value) {
+	m_mapping[priority].enabled = false;
+	m_mapping[priority].policy = policy;
+	m_mapping[priority].value = value;
+	m_mapping[priority].enabled = true;
+}
+
+task_stats_t ThreadPool::get_stats(Task::Priority priority) {
+	task_stats_t stats;
+	stats.count = m_stats[priority].count;
+	stats.total_us = m_stats[priority].total_us;
+	stats.max_us = m_stats[priority].max_us;
+	return stats;
+}
+
+// Waits for |latch| to be released. A pool worker keeps running tasks in
+// the meantime instead of blocking, so nested waits can't starve the pool,
+// and only sleeps once there is nothing left for it to run.
+void ThreadPool::wait(TaskLatch &latch) {
+	Worker *worker = ms_current;
+	if (worker == nullptr || worker->m_pool != this) {
+		latch.wait();
+		return;
+	}
 
-	for (auto &item : m_threads) {
-		if (item.second == false) {
-			item.second = true;
-			return item.first;
+	int spins = 0;
+	while (!latch.ready()) {
+		Task *task = take(worker);
+		if (task != nullptr) {
+			spins = 0;
+			account(worker, task);
+			task->run();
+			continue;
 		}
+
+		// The tasks we wait for are running elsewhere, don't burn a CPU
+		// on them. Wake up now and then to help with whatever was queued.
+		if (spins < kWaitSpins) {
+			++spins;
+			sched_yield();
+		} else {
+			latch.wait_for(kWaitPollMs);
+		}
+	}
+}
+
+// Runs |body| over [begin, end) in chunks of at least |grain| indexes and
+// returns when every chunk is done. A zero |grain| picks one that gives
+// each possible worker about eight chunks.
+void ThreadPool::parallel_for(size_t begin, size_t end,
+	const std::function<void(size_t, size_t)> &body, size_t grain) {
+	if (end <= begin) return;
+	if (grain == 0)
+		grain = MAX((end - begin) / (8 * static_cast<size_t>(m_max)), 1);
+
+	TaskLatch latch(1);
+	submit(new RangeTask(this, begin, end, grain, &body, &latch));
+	wait(latch);
+}
+
+// A range is worth splitting while some worker is idle or the calling
+// worker has nothing left for thieves.
+bool ThreadPool::wants_split() {
+	if (m_idleCount.load() > 0) return true;
+
+	Worker *worker = ms_current;
+	return worker != nullptr && worker->m_pool == this &&
+		worker->m_deques[Task::NORMAL].empty() &&
+		m_active.load() > 1;
+}
+
+Task *ThreadPool::take(Worker *worker) {
+	Task *task = nullptr;
+	uint64_t now = now_ns();
+
+	for (int level = kPriorityLevels - 1; level >= 0; --level) {
+		task = take_aged(level, now);
+		if (task != nullptr) return task;
+		task = worker->m_deques[level].pop();
+		if (task != nullptr) return task;
+		task = take_injected(level);
+		if (task != nullptr) return task;
+		task = steal(worker, level);
+		if (task != nullptr) return task;
+	}
+
+	return nullptr;
+}
+
+// Returns the oldest injected task of a priority below |level| that has
+// waited long enough to be promoted up to |level|.
+Task *ThreadPool::take_aged(int level, uint64_t now) {
+	for (int lower = 0; lower < level; ++lower) {
+		uint64_t limit = (level - lower) * m_agingNs.load();
+		if (m_injected[lower].load() == 0) continue;
+		if (now - m_oldest[lower].load() < limit) continue;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_injection[lower].empty() &&
+			now - m_injection[lower].front()->m_submitted >= limit)
+			return pop_injected(lower);
 	}
 
 	return nullptr;
 }
 
-void ThreadPool::flush() {
+Task *ThreadPool::take_injected(int level) {
+	if (m_injected[level].load() == 0) return nullptr;
+
 	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_injection[level].empty() ? nullptr : pop_injected(level);
+}
 
-	for (auto &item : m_threads) {
-		item.second = false;
-		if (item.first->get_state() == Worker::State::RUNNING) {
-			item.first->suspend();						
+// Must be called with |m_mutex| held and |m_injection[level]| not empty.
+Task *ThreadPool::pop_injected(int level) {
+	Task *task = m_injection[level].front();
+	m_injection[level].pop_front();
+	--m_injected[level];
+	m_oldest[level] = m_injection[level].empty() ?
+		0 : m_injection[level].front()->m_submitted;
+	return task;
+}
+
+Task *ThreadPool::steal(Worker *thief, int level) {
+	size_t count = m_workers.size();
+	for (size_t i = 1; i < count; ++i) {
+		Worker *victim = m_workers[(thief->m_index + i) % count];
+		Task *task = victim->m_deques[level].steal();
+		if (task != nullptr) return task;
+	}
+
+	return nullptr;
+}
+
+// Records the queueing latency of |task| and, if its priority is mapped to
+// a scheduling class, moves |worker| to that class before it runs.
+void ThreadPool::account(Worker *worker, Task *task) {
+	int level = task->get_priority();
+	uint64_t wait_us = (now_ns() - task->m_submitted) / 1000;
+
+	++m_stats[level].count;
+	m_stats[level].total_us += wait_us;
+	uint64_t max_us = m_stats[level].max_us.load();
+	while (wait_us > max_us &&
+		!m_stats[level].max_us.compare_exchange_weak(max_us, wait_us)) {
+	}
+
+	uint64_t now = task->m_submitted + wait_us * 1000;
+	if (wait_us * 1000 >= m_growNs.load() && m_idleCount.load() == 0)
+		grow(now);
+
+	int target = m_mapping[level].enabled ? level : -1;
+	if (target == worker->m_level) return;
+	worker->m_level = target;
+
+	sched_param param;
+	memset(&param, 0, sizeof(param));
+	int policy = (target == -1) ? SCHED_OTHER : m_mapping[target].policy;
+	int value = (target == -1) ? 0 : m_mapping[target].value;
+	if (policy != SCHED_OTHER) param.sched_priority = value;
+
+	int rc = sched_setscheduler(worker->m_ktid, policy, &param);
+	if (rc == 0 && policy == SCHED_OTHER)
+		rc = setpriority(PRIO_PROCESS, worker->m_ktid, value);
+	if (rc != 0)
+		LOG_ERROR(LOG_TAG, "unable to move worker %s to policy %d value %d: %s",
+			worker->m_name, policy, value, strerror(errno));
+}
+
+bool ThreadPool::has_work() {
+	for (int level = 0; level < kPriorityLevels; ++level) {
+		if (m_injected[level].load() > 0) return true;
+	}
+	for (auto &worker : m_workers) {
+		for (int level = 0; level < kPriorityLevels; ++level) {
+			if (!worker->m_deques[level].empty()) return true;
 		}
 	}
+	return false;
 }
 
-bool ThreadPool::pop(Worker* worker) {
-	std::lock_guard<std::mutex> lock(m_mutex);
+// Returns how long the oldest injected task has been waiting.
+uint64_t ThreadPool::oldest_wait(uint64_t now) {
+	uint64_t wait = 0;
+	for (int level = 0; level < kPriorityLevels; ++level) {
+		if (m_injected[level].load() == 0) continue;
+		uint64_t oldest = m_oldest[level].load();
+		if (oldest != 0 && now > oldest && now - oldest > wait)
+			wait = now - oldest;
+	}
+	return wait;
+}
 
-	for (std::vector<std::pair<Worker*, bool>>::iterator it = m_threads.begin();
-		it != m_threads.end(); ++it) {
-		if (it->first == worker && it->second == true) {
-			delete it->first;
-			m_threads.erase(it);
-			return true;
+// Starts one more worker, at most one per grow threshold so a single burst
+// doesn't spawn up to |m_max| at once.
+void ThreadPool::grow(uint64_t now) {
+	if (m_active.load() >= m_max) return;
+	if (now - m_lastSpawn.load() < m_growNs.load()) return;
+
+	std::lock_guard<std::mutex> lock(m_resizeMutex);
+	if (m_stopping || m_active.load() >= m_max) return;
+	if (now - m_lastSpawn.load() < m_growNs.load()) return;
+
+	for (auto &worker : m_workers) {
+		Worker::State state = worker->get_state();
+		if (state != Worker::CREATING && state != Worker::DEAD) continue;
+
+		// Reap the thread of a worker that retired from this slot.
+		worker->join();
+		if (worker->start()) {
+			++m_active;
+			++m_spawned;
+			m_lastSpawn = now;
 		}
+		return;
 	}
+}
 
-	return false;
+// Parks |worker| until there is work for it. Returns false if the worker
+// idled out and should retire.
+bool ThreadPool::park(Worker *worker) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (worker->get_state() == Worker::DEAD) return true;
+		m_idle.push_back(worker);
+		++m_idleCount;
+	}
+
+	// Re-check after advertising ourselves idle, a task pushed before that
+	// would otherwise be left behind with nobody to wake for it.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (has_work()) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto it = m_idle.begin(); it != m_idle.end(); ++it) {
+			if (*it == worker) {
+				m_idle.erase(it);
+				--m_idleCount;
+				return true;
+			}
+		}
+		// Already picked by wake_one(), consume its signal below.
+		worker->m_sem.wait();
+		return true;
+	}
+
+	while (!worker->m_sem.wait_for(m_idleTimeoutMs.load())) {
+		bool picked = true;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (auto it = m_idle.begin(); it != m_idle.end(); ++it) {
+				if (*it != worker) continue;
+				picked = false;
+
+				int active = m_active.load();
+				if (active > m_min &&
+					m_active.compare_exchange_strong(active, active - 1)) {
+					m_idle.erase(it);
+					--m_idleCount;
+					++m_retired;
+					return false;
+				}
+				break;
+			}
+		}
+
+		// Picked by wake_one() right as we timed out, take its signal.
+		if (picked) {
+			worker->m_sem.wait();
+			break;
+		}
+	}
+
+	return true;
+}
+
+void ThreadPool::wake_one() {
+	Worker *worker = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_idle.empty()) return;
+		worker = m_idle.back();
+		m_idle.pop_back();
+		--m_idleCount;
+	}
+
+	worker->wake();
 }
 
 void ThreadPool::terminate() {
+	// Close the pool to grow() first, otherwise a submitter could restart a
+	// slot we are about to join and free.
+	{
+		std::lock_guard<std::mutex> lock(m_resizeMutex);
+		m_stopping = true;
+	}
+
+	for (auto &worker : m_workers)
+		worker->stop();
+	// Join everybody before freeing anyone, a late thief may still be
+	// looking at a peer's deque.
+	for (auto &worker : m_workers)
+		worker->join();
+	for (auto &worker : m_workers)
+		delete worker;
+	m_workers.clear();
+
 	std::lock_guard<std::mutex> lock(m_mutex);
+	m_idle.clear();
+	m_idleCount = 0;
+	for (int level = 0; level < kPriorityLevels; ++level) {
+		m_injection[level].clear();
+		m_injected[level] = 0;
+		m_oldest[level] = 0;
+	}
+}
+
+TaskGraph::TaskGraph(ThreadPool *pool)
+	:m_pool(pool)
+	,m_nodes()
+	,m_latch(0) {
+	CHECK(pool != nullptr);
+}
+
+TaskGraph::~TaskGraph() {
+	for (auto &node : m_nodes)
+		delete node;
+	m_nodes.clear();
+}
+
+TaskGraph::node_t TaskGraph::add(const std::function<void()> &fn, Task::Priority priority) {
+	m_nodes.push_back(new Node(this, m_nodes.size(), fn, priority));
+	return m_nodes.size() - 1;
+}
+
+// |after| won't start before |before| has completed.
+void TaskGraph::precede(node_t before, node_t after) {
+	CHECK(before < m_nodes.size() && after < m_nodes.size());
+	m_nodes[before]->m_successors.push_back(m_nodes[after]);
+	++m_nodes[after]->m_predecessors;
+}
 
-	for (auto &item : m_threads) {
-		item.second = false;
-		if (item.first != nullptr) {
-			item.first->stop();
-			item.first->join();			
-		}		
-		delete item.first;
+// Runs every node once, as soon as all of its predecessors are done, and
+// returns when the whole graph has completed. Returns false without
+// running anything if the graph has a cycle.
+bool TaskGraph::run() {
+	if (has_cycle()) {
+		LOG_ERROR(LOG_TAG, "task graph has a dependency cycle");
+		return false;
 	}
-	m_threads.clear();
-}
\ No newline at end of file
+	if (m_nodes.empty()) return true;
+
+	for (auto &node : m_nodes)
+		node->m_pending = node->m_predecessors;
+	m_latch.add(m_nodes.size());
+
+	for (auto &node : m_nodes) {
+		if (node->m_predecessors == 0)
+			m_pool->submit(node);
+	}
+
+	m_pool->wait(m_latch);
+	return true;
+}
+
+bool TaskGraph::has_cycle() {
+	std::vector<size_t> pending;
+	std::vector<Node*> ready;
+	for (auto &node : m_nodes) {
+		pending.push_back(node->m_predecessors);
+		if (node->m_predecessors == 0) ready.push_back(node);
+	}
+
+	size_t visited = 0;
+	while (!ready.empty()) {
+		Node *node = ready.back();
+		ready.pop_back();
+		++visited;
+		for (auto &next : node->m_successors) {
+			if (--pending[next->m_index] == 0) ready.push_back(next);
+		}
+	}
+
+	return visited != m_nodes.size();
+}
+
+void TaskGraph::Node::run() {
+	m_fn();
+
+	for (auto &next : m_successors) {
+		if (--next->m_pending == 0)
+			m_graph->m_pool->submit(next);
+	}
+	m_graph->m_latch.done();
+}
@@ -0,0 +1,118 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+/*
+ * Benchmark of Alarm with 100k active alarms: how long SetTimer() takes
+ * to schedule them, to reschedule them, and how long CancelTimer() takes,
+ * without slack and with a slack wide enough that most wakeups could be
+ * shared. Deadlines are far out so nothing fires meanwhile. Build it from
+ * utils/ with:
+ *   g++ -std=c++17 -O2 -Iinc -include string.h test/alarm_bench.cxx src/alarm.cxx src/thread.cxx \
+ *     src/reactor.cxx src/fixed_queue.cxx src/eventlock.cxx src/seqlist.cxx \
+ *     src/allocator.cxx src/concurrency.cxx src/placement.cxx -lpthread -lrt
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "utils.h"
+#include "seqlist.h"
+#include "eventlock.h"
+#include "fixed_queue.h"
+#include "reactor.h"
+#include "thread.h"
+#include "alarm.h"
+
+#define BENCH_ALARMS	100000
+#define BASE_MS			(600 * 1000)	//ten minutes, never reached
+#define SPREAD_MS		(600 * 1000)
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void never_called(void* data) {
+	(void)data;
+}
+
+// Returns the average ns per SetTimer() over all |timers|.
+static double schedule_all(Alarm *alarm, std::vector<alarm_data_t*> &timers,
+	const std::vector<uint64_t> &intervals, uint64_t slack) {
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < timers.size(); i++)
+		alarm->SetTimer(timers[i], intervals[i], never_called, NULL, slack);
+	return (double)(now_ns() - start) / timers.size();
+}
+
+static double cancel_all(Alarm *alarm, std::vector<alarm_data_t*> &timers) {
+	uint64_t start = now_ns();
+	for (size_t i = 0; i < timers.size(); i++)
+		alarm->CancelTimer(timers[i]);
+	return (double)(now_ns() - start) / timers.size();
+}
+
+static void bench(Alarm *alarm, uint64_t slack) {
+	std::vector<alarm_data_t*> timers;
+	std::vector<uint64_t> intervals;
+	srand(1);
+	uint64_t start = now_ns();
+	for (int i = 0; i < BENCH_ALARMS; i++) {
+		timers.push_back(alarm->CreateTimer("bench", false));
+		intervals.push_back(BASE_MS + (uint64_t)rand() % SPREAD_MS);
+	}
+	double create_ns = (double)(now_ns() - start) / BENCH_ALARMS;
+
+	double schedule_ns = schedule_all(alarm, timers, intervals, slack);
+	// Every alarm is pending already, this moves each one in the heaps.
+	for (size_t i = 0; i < intervals.size(); i++)
+		intervals[i] = BASE_MS + (uint64_t)rand() % SPREAD_MS;
+	double reschedule_ns = schedule_all(alarm, timers, intervals, slack);
+	double cancel_ns = cancel_all(alarm, timers);
+
+	start = now_ns();
+	for (size_t i = 0; i < timers.size(); i++)
+		alarm->FreeTimer(timers[i]);
+	double free_ns = (double)(now_ns() - start) / BENCH_ALARMS;
+
+	printf("%10llu %10.0f %10.0f %10.0f %10.0f %10.0f\n", (unsigned long long)slack,
+		create_ns, schedule_ns, reschedule_ns, cancel_ns, free_ns);
+}
+
+int main(void) {
+	Alarm alarm;
+
+	printf("%d alarms, ns per call\n", BENCH_ALARMS);
+	printf("%10s %10s %10s %10s %10s %10s\n", "slack ms", "create", "schedule",
+		"reschedule", "cancel", "free");
+	bench(&alarm, 0);
+	bench(&alarm, SPREAD_MS);
+
+	return 0;
+}
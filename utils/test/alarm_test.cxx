@@ -0,0 +1,88 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+/*
+ * Regression tests for Alarm, a plain program that exits non-zero on
+ * failure. Build it from utils/ with:
+ *   g++ -std=c++17 -Iinc -include string.h test/alarm_test.cxx src/alarm.cxx src/thread.cxx \
+ *     src/reactor.cxx src/fixed_queue.cxx src/eventlock.cxx src/seqlist.cxx \
+ *     src/allocator.cxx src/concurrency.cxx src/placement.cxx -lpthread -lrt
+ */
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "utils.h"
+#include "seqlist.h"
+#include "eventlock.h"
+#include "fixed_queue.h"
+#include "reactor.h"
+#include "thread.h"
+#include "alarm.h"
+
+static std::atomic<int> s_calls(0);
+static std::atomic<bool> s_inCallback(false);
+
+static void overrun_callback(void* data) {
+	(void)data;
+	if (s_calls++ == 0) {
+		s_inCallback = true;
+		usleep(50000);	// ten periods
+	}
+}
+
+// A periodic alarm canceled while its callback overruns the period must
+// not run again, nor leave entries behind on its callback lane.
+static bool test_cancel_periodic_during_overrun(void) {
+	Alarm alarm;
+	alarm_data_t *timer = alarm.CreateTimer("overrun", true);
+	alarm.SetTimer(timer, 5, overrun_callback, NULL);
+
+	// Let a few periods expire behind the running callback first.
+	while (!s_inCallback) usleep(1000);
+	usleep(30000);
+	alarm.CancelTimer(timer);
+	int calls = s_calls;
+	alarm.FreeTimer(timer);
+
+	usleep(100000);
+	if (s_calls != calls) {
+		printf("%s: %d callbacks after cancel\n", __func__, s_calls - calls);
+		return false;
+	}
+	return true;
+}
+
+int main(void) {
+	bool success = true;
+
+	success &= test_cancel_periodic_during_overrun();
+
+	printf("%s\n", success ? "PASS" : "FAIL");
+	return success ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+/*
+ * Contention benchmark of Semaphore and EventFlag against the primitives
+ * they replace: ConCurrency (pthread mutex and condition) and EventLock,
+ * both in userspace and exported as the eventfd it used to always be.
+ * The thread count defaults to 4. Build it from utils/ with:
+ *   g++ -std=c++17 -O2 -Iinc test/concurrency_bench.cxx src/concurrency.cxx \
+ *     src/eventlock.cxx -lpthread -lrt
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+#include "concurrency.h"
+#include "eventlock.h"
+
+#define UNCONTENDED_OPS	1000000
+#define RING_LAPS		20000
+#define SHARED_OPS		200000
+#define PINGPONG_ROUNDS	50000
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Counting semaphores under test, all with the same wait()/signal().
+class SemaphoreBench {
+public:
+	void wait() { m_sem.wait(); }
+	void signal() { m_sem.signal(); }
+	static const char* name() { return "Semaphore"; }
+private:
+	Semaphore m_sem;
+};
+
+class ConCurrencyBench {
+public:
+	ConCurrencyBench() :m_sem(0) {}
+	void wait() { m_sem.wait(); }
+	void signal() { m_sem.signal(); }
+	static const char* name() { return "ConCurrency"; }
+private:
+	ConCurrency m_sem;
+};
+
+class EventLockBench {
+public:
+	EventLockBench() :m_lock(0) {}
+	void wait() { m_lock.Wait(); }
+	void signal() { m_lock.Post(); }
+	static const char* name() { return "EventLock"; }
+private:
+	EventLock m_lock;
+};
+
+class EventLockFdBench {
+public:
+	EventLockFdBench() :m_lock(0) { m_lock.GetFd(); }
+	void wait() { m_lock.Wait(); }
+	void signal() { m_lock.Post(); }
+	static const char* name() { return "EventLock (eventfd)"; }
+private:
+	EventLock m_lock;
+};
+
+// Manual reset events under test, with the same set()/reset()/wait().
+class EventFlagBench {
+public:
+	void set() { m_event.set(); }
+	void reset() { m_event.reset(); }
+	void wait() { m_event.wait(); }
+	static const char* name() { return "EventFlag"; }
+private:
+	EventFlag m_event;
+};
+
+class ConditionFlagBench {
+public:
+	ConditionFlagBench() :m_set(false), m_cond(&m_mutex) {}
+	void set() {
+		m_mutex.lock();
+		m_set = true;
+		m_cond.broadcast();
+		m_mutex.unlock();
+	}
+	void reset() {
+		m_mutex.lock();
+		m_set = false;
+		m_mutex.unlock();
+	}
+	void wait() {
+		m_mutex.lock();
+		while (!m_set)
+			m_cond.wait();
+		m_mutex.unlock();
+	}
+	static const char* name() { return "Mutex/Condition"; }
+private:
+	bool m_set;
+	Mutex m_mutex;
+	Condition m_cond;
+};
+
+// signal() then wait() on one thread, nobody ever sleeps.
+template<typename S>
+static double bench_uncontended(void) {
+	S sem;
+	uint64_t start = now_ns();
+	for (int i = 0; i < UNCONTENDED_OPS; i++) {
+		sem.signal();
+		sem.wait();
+	}
+	return (double)(now_ns() - start) / UNCONTENDED_OPS;
+}
+
+// A token goes round a ring of |threads|, each waiting on its own semaphore
+// and signaling the next one: every hop is a wakeup.
+template<typename S>
+static double bench_ring(int threads) {
+	std::vector<S> sems(threads);
+	std::vector<std::thread> ring;
+	for (int t = 0; t < threads; t++) {
+		ring.emplace_back([&sems, t, threads] {
+			for (int lap = 0; lap < RING_LAPS; lap++) {
+				sems[t].wait();
+				sems[(t + 1) % threads].signal();
+			}
+		});
+	}
+
+	uint64_t start = now_ns();
+	sems[0].signal();
+	for (auto &thread : ring)
+		thread.join();
+	// The last hop signaled sems[0] once more.
+	sems[0].wait();
+	return (double)(now_ns() - start) / ((uint64_t)RING_LAPS * threads);
+}
+
+// Half of |threads| signal one semaphore, the other half take the counts.
+template<typename S>
+static double bench_shared(int threads) {
+	int producers = threads / 2 > 0 ? threads / 2 : 1;
+	int consumers = producers;
+	int per_thread = SHARED_OPS / producers;
+	S sem;
+	std::vector<std::thread> pool;
+
+	uint64_t start = now_ns();
+	for (int t = 0; t < consumers; t++) {
+		pool.emplace_back([&sem, per_thread] {
+			for (int i = 0; i < per_thread; i++)
+				sem.wait();
+		});
+	}
+	for (int t = 0; t < producers; t++) {
+		pool.emplace_back([&sem, per_thread] {
+			for (int i = 0; i < per_thread; i++)
+				sem.signal();
+		});
+	}
+	for (auto &thread : pool)
+		thread.join();
+	return (double)(now_ns() - start) / ((uint64_t)per_thread * producers);
+}
+
+// Two threads hand the turn back and forth with a pair of events.
+template<typename E>
+static double bench_pingpong(void) {
+	E ping;
+	E pong;
+	std::thread peer([&ping, &pong] {
+		for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+			ping.wait();
+			ping.reset();
+			pong.set();
+		}
+	});
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+		ping.set();
+		pong.wait();
+		pong.reset();
+	}
+	peer.join();
+	return (double)(now_ns() - start) / PINGPONG_ROUNDS;
+}
+
+template<typename S>
+static void report_semaphore(int threads) {
+	printf("%-20s %14.1f %14.1f %14.1f\n", S::name(), bench_uncontended<S>(),
+		bench_ring<S>(threads), bench_shared<S>(threads));
+}
+
+int main(int argc, char *argv[]) {
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	if (threads < 2) threads = 2;
+
+	printf("Semaphores, ns per operation, %d threads\n", threads);
+	printf("%-20s %14s %14s %14s\n", "", "uncontended", "ring hop", "shared");
+	report_semaphore<SemaphoreBench>(threads);
+	report_semaphore<ConCurrencyBench>(threads);
+	report_semaphore<EventLockBench>(threads);
+	report_semaphore<EventLockFdBench>(threads);
+
+	printf("\nEvents, ns per round trip between two threads\n");
+	printf("%-20s %14.1f\n", EventFlagBench::name(), bench_pingpong<EventFlagBench>());
+	printf("%-20s %14.1f\n", ConditionFlagBench::name(), bench_pingpong<ConditionFlagBench>());
+
+	return 0;
+}
@@ -0,0 +1,166 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+/*
+ * Regression tests for the coroutine awaitables, a plain program that
+ * exits non-zero on failure. Build it from utils/ with:
+ *   g++ -std=c++20 -Iinc -include string.h test/coroutine_test.cxx src/future.cxx \
+ *     src/thread.cxx src/reactor.cxx src/fixed_queue.cxx src/eventlock.cxx \
+ *     src/seqlist.cxx src/allocator.cxx src/concurrency.cxx src/placement.cxx \
+ *     -lpthread -lrt
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <new>
+
+#include "utils.h"
+#include "thread.h"
+#include "future.h"
+#include "coroutine.h"
+
+static std::atomic<size_t> s_allocs(0);
+
+void* operator new(size_t size) {
+	s_allocs++;
+	void *p = malloc(size ? size : 1);
+	if (p == NULL) throw std::bad_alloc();
+	return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static Thread *s_first = NULL;
+static Thread *s_second = NULL;
+static std::atomic<int> s_misplaced(0);
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void ready_future(void *context, void *arg) {
+	static_cast<Future*>(context)->Ready(arg);
+}
+
+static CoTask hop(Future *future, long offset) {
+	co_await SwitchTo(s_first);
+	if (!s_first->IsSelf()) s_misplaced++;
+
+	void *value = co_await AwaitFuture(future, s_second);
+	if (!s_second->IsSelf()) s_misplaced++;
+
+	uint64_t start = now_ms();
+	co_await DelayOn(s_first, 20);
+	if (!s_first->IsSelf() || now_ms() - start < 19) s_misplaced++;
+
+	co_return reinterpret_cast<void*>(reinterpret_cast<long>(value) + offset);
+}
+
+// SwitchTo, AwaitFuture and DelayOn each resume on the thread asked for,
+// and the result reaches the CoTask's Future.
+static bool test_thread_hops(void) {
+	Future future;
+	CoTask task = hop(&future, 1);
+	s_second->PostDelayed(ready_future, &future, reinterpret_cast<void*>(41), 10);
+
+	long result = reinterpret_cast<long>(task.GetFuture()->Await());
+	if (result != 42 || s_misplaced != 0) {
+		printf("%s: result %ld, %d resumed on the wrong thread\n", __func__,
+			result, s_misplaced.load());
+		return false;
+	}
+	return true;
+}
+
+static CoTask relay(Future *future) {
+	void *value = co_await AwaitFuture(future, NULL);
+	co_return value;
+}
+
+// Once the frame pool is warm, a coroutine awaiting a pending Future
+// allocates nothing: the Future lives in the frame and the continuation
+// in the awaiter.
+static bool test_await_without_allocation(void) {
+	for (int i = 0; i < 16; i++) {
+		Future future;
+		CoTask task = relay(&future);
+		future.Ready(NULL);
+	}
+
+	size_t before = s_allocs;
+	long sum = 0;
+	for (long i = 0; i < 1000; i++) {
+		Future future;
+		CoTask task = relay(&future);
+		future.Ready(reinterpret_cast<void*>(i));
+		sum += reinterpret_cast<long>(task.GetFuture()->Await());
+	}
+	size_t allocs = s_allocs - before;
+
+	if (allocs != 0 || sum != 999 * 1000 / 2) {
+		printf("%s: %zu allocations, sum %ld\n", __func__, allocs, sum);
+		return false;
+	}
+	return true;
+}
+
+static CoTask forward(Future *future, Future *done) {
+	void *value = co_await AwaitFuture(future, s_second);
+	done->Ready(value);
+	co_return value;
+}
+
+// A CoTask dropped while its body is suspended leaves the frame to the
+// body, which still completes and frees it.
+static bool test_drop_before_completion(void) {
+	Future future;
+	Future done;
+	{
+		CoTask task = forward(&future, &done);
+	}
+	s_first->Post(ready_future, &future, reinterpret_cast<void*>(7));
+
+	void *value = done.Await();
+	if (value != reinterpret_cast<void*>(7)) {
+		printf("%s: body finished with %p\n", __func__, value);
+		return false;
+	}
+	return true;
+}
+
+int main(void) {
+	bool success = true;
+
+	s_first = new Thread("co_first");
+	s_second = new Thread("co_second");
+
+	success &= test_thread_hops();
+	success &= test_await_without_allocation();
+	success &= test_drop_before_completion();
+
+	delete s_first;
+	delete s_second;
+
+	printf("%s\n", success ? "PASS" : "FAIL");
+	return success ? 0 : 1;
+}
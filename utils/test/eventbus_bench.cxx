@@ -0,0 +1,212 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+/*
+ * Events per second through EventBus against the map+list design it
+ * replaced: handlers looked up in a std::map keyed by std::type_index, a
+ * std::list of heap handlers walked under a mutex held across the whole
+ * dispatch. MAIN events only, so both deliver on the publisher's thread.
+ * The publisher thread count defaults to 4. Build it from utils/ with:
+ *   g++ -std=c++17 -O2 -Iinc -include string.h test/eventbus_bench.cxx src/threadpool.cxx \
+ *     src/thread.cxx src/reactor.cxx src/fixed_queue.cxx src/eventlock.cxx src/seqlist.cxx \
+ *     src/allocator.cxx src/concurrency.cxx src/placement.cxx -lpthread -lrt
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <typeindex>
+#include <vector>
+
+#include "utils.h"
+#include "eventbus.h"
+
+#define EVENTS_PER_THREAD	500000
+#define LISTENERS_PER_TYPE	4
+
+template<int N>
+class BenchEvent : public Event {
+public:
+	BenchEvent(int id)
+		:Event(nullptr, id, Event::MAIN) {}
+};
+
+template<int N>
+class BenchListener : public IEventListener<BenchEvent<N> > {
+public:
+	BenchListener()
+		:m_sum(0) {}
+	virtual void onEvent(BenchEvent<N>& event) {
+		m_sum.fetch_add(event.getId(), std::memory_order_relaxed);
+	}
+private:
+	std::atomic<uint64_t> m_sum;
+};
+
+/**
+ * \brief The dispatch path of the old EventBus
+ *
+ * Same lookup and locking, with a recursive mutex where the old one
+ * re-locked a plain std::mutex on the same path and deadlocked.
+ */
+class MapListBus {
+public:
+	MapListBus() {}
+	~MapListBus() {
+		for (auto &entry : m_handlers) {
+			for (auto &handler : *entry.second)
+				delete handler;
+			delete entry.second;
+		}
+	}
+
+	template<typename T>
+	void addListener(IEventListener<T>* listener) {
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		HandlerList_t* handlers = m_handlers[typeid(T)];
+		if (handlers == nullptr) {
+			handlers = new HandlerList_t();
+			m_handlers[typeid(T)] = handlers;
+		}
+		handlers->push_back(new Handler(static_cast<void*>(listener)));
+	}
+	template<typename T>
+	void dispatchEvent(T* event) {
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		m_events.push(event);
+		processEvent<T>();
+	}
+
+private:
+	class Handler {
+	public:
+		Handler(void* listener)
+			:m_listener(listener) {}
+		void* getListener() { return m_listener; }
+	private:
+		void* m_listener;
+	};
+	template<typename T>
+	void processEvent() {
+		std::lock_guard<std::recursive_mutex> lock(m_mutex);
+		Event* event = m_events.front();
+		HandlerList_t* handlers = m_handlers[typeid(T)];
+		if (handlers != nullptr) {
+			for (auto &handler : *handlers)
+				static_cast<IEventListener<T>*>(handler->getListener())->onEvent(*static_cast<T*>(event));
+		}
+		m_events.pop();
+		delete event;
+	}
+
+	typedef std::list<Handler*> HandlerList_t;
+	std::map<std::type_index, HandlerList_t*> m_handlers;
+	std::queue<Event*> m_events;
+	std::recursive_mutex m_mutex;
+};
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Registers LISTENERS_PER_TYPE listeners for each of the four event types.
+template<typename Bus>
+class Fixture {
+public:
+	Fixture(Bus* bus) {
+		for (int i = 0; i < LISTENERS_PER_TYPE; i++) {
+			bus->template addListener<BenchEvent<0> >(&m_l0[i]);
+			bus->template addListener<BenchEvent<1> >(&m_l1[i]);
+			bus->template addListener<BenchEvent<2> >(&m_l2[i]);
+			bus->template addListener<BenchEvent<3> >(&m_l3[i]);
+		}
+	}
+private:
+	BenchListener<0> m_l0[LISTENERS_PER_TYPE];
+	BenchListener<1> m_l1[LISTENERS_PER_TYPE];
+	BenchListener<2> m_l2[LISTENERS_PER_TYPE];
+	BenchListener<3> m_l3[LISTENERS_PER_TYPE];
+};
+
+// Heap events through dispatchEvent(), the only way into either bus.
+template<typename Bus>
+static void dispatch_events(Bus* bus) {
+	for (int i = 0; i < EVENTS_PER_THREAD; i += 4) {
+		bus->dispatchEvent(new BenchEvent<0>(i));
+		bus->dispatchEvent(new BenchEvent<1>(i));
+		bus->dispatchEvent(new BenchEvent<2>(i));
+		bus->dispatchEvent(new BenchEvent<3>(i));
+	}
+}
+
+// Pooled events through publish(), EventBus only.
+static void publish_events(EventBus* bus) {
+	for (int i = 0; i < EVENTS_PER_THREAD; i += 4) {
+		bus->publish<BenchEvent<0> >(i);
+		bus->publish<BenchEvent<1> >(i);
+		bus->publish<BenchEvent<2> >(i);
+		bus->publish<BenchEvent<3> >(i);
+	}
+}
+
+template<typename Bus>
+static double run_threads(Bus* bus, int threads, void (*body)(Bus*)) {
+	std::vector<std::thread> publishers;
+	uint64_t start = now_ns();
+	for (int t = 0; t < threads; t++)
+		publishers.emplace_back(body, bus);
+	for (auto &thread : publishers)
+		thread.join();
+	uint64_t elapsed = now_ns() - start;
+	return (double)EVENTS_PER_THREAD * threads * 1000000000.0 / elapsed;
+}
+
+static void report(const char* name, double one, double many) {
+	printf("%-28s %16.0f %16.0f\n", name, one, many);
+}
+
+int main(int argc, char *argv[]) {
+	int threads = argc > 1 ? atoi(argv[1]) : 4;
+	if (threads < 1) threads = 1;
+
+	MapListBus old_bus;
+	Fixture<MapListBus> old_fixture(&old_bus);
+	EventBus bus;
+	Fixture<EventBus> fixture(&bus);
+
+	printf("Events/sec, %d listeners per type, 4 types\n", LISTENERS_PER_TYPE);
+	printf("%-28s %16s %16s\n", "", "1 thread", "threads");
+	printf("%-28s %16s %16d\n", "", "", threads);
+	report("map+list dispatchEvent", run_threads(&old_bus, 1, dispatch_events<MapListBus>),
+		run_threads(&old_bus, threads, dispatch_events<MapListBus>));
+	report("EventBus dispatchEvent", run_threads(&bus, 1, dispatch_events<EventBus>),
+		run_threads(&bus, threads, dispatch_events<EventBus>));
+	report("EventBus publish", run_threads(&bus, 1, publish_events),
+		run_threads(&bus, threads, publish_events));
+
+	return 0;
+}
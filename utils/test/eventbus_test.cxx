@@ -0,0 +1,176 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+/*
+ * Regression tests for EventBus, a plain program that exits non-zero on
+ * failure. Build it from utils/ with:
+ *   g++ -std=c++17 -Iinc -include string.h test/eventbus_test.cxx src/threadpool.cxx \
+ *     src/thread.cxx src/reactor.cxx src/fixed_queue.cxx src/eventlock.cxx src/seqlist.cxx \
+ *     src/allocator.cxx src/concurrency.cxx src/placement.cxx -lpthread -lrt
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "utils.h"
+#include "eventbus.h"
+
+#define SLOW_LISTENER_US 100000
+
+class SlowEvent : public Event {
+public:
+	SlowEvent(ThreadMode mode)
+		:Event(nullptr, 0, mode) {}
+};
+
+class SlowListener : public IEventListener<SlowEvent> {
+public:
+	SlowListener()
+		:m_calls(0) {}
+	virtual void onEvent(SlowEvent& event) {
+		(void)event;
+		usleep(SLOW_LISTENER_US);
+		m_calls++;
+	}
+	int getCalls() { return m_calls; }
+private:
+	std::atomic<int> m_calls;
+};
+
+// Scan result style event keyed by a 48-bit address.
+class AddressEvent : public Event {
+public:
+	AddressEvent(uint64_t address, int seq)
+		:Event(nullptr, seq, Event::BACKGROUND)
+		,m_address(address) {}
+	uint64_t getAddress() { return m_address; }
+private:
+	uint64_t m_address;
+};
+
+// Holds the drain in its first delivery until open() is called.
+class GatedListener : public IEventListener<AddressEvent> {
+public:
+	GatedListener()
+		:m_entered(false)
+		,m_open(false) {}
+	virtual void onEvent(AddressEvent& event) {
+		m_entered = true;
+		while (!m_open)
+			usleep(1000);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_seqs.push_back(event.getId());
+	}
+	void waitEntered() {
+		while (!m_entered)
+			usleep(1000);
+	}
+	void open() { m_open = true; }
+	std::vector<int> getSeqs() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_seqs;
+	}
+private:
+	std::atomic<bool> m_entered;
+	std::atomic<bool> m_open;
+	std::mutex m_mutex;
+	std::vector<int> m_seqs;
+};
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Two slow parallel listeners of a MAIN event must overlap, so delivery
+// takes about one listener's time, not the sum of both.
+static bool test_parallel_listeners_overlap(void) {
+	EventBus bus;
+	SlowListener first;
+	SlowListener second;
+	bus.addListener<SlowEvent>(&first);
+	bus.addListener<SlowEvent>(&second);
+	bus.setParallel<SlowEvent>(true);
+
+	uint64_t start = now_us();
+	bus.publish<SlowEvent>(Event::MAIN);
+	uint64_t elapsed = now_us() - start;
+
+	if (first.getCalls() != 1 || second.getCalls() != 1) {
+		printf("%s: listeners called %d and %d times\n", __func__,
+			first.getCalls(), second.getCalls());
+		return false;
+	}
+	if (elapsed >= 2 * SLOW_LISTENER_US * 9 / 10) {
+		printf("%s: delivery took %llu us, listeners ran serially\n", __func__,
+			(unsigned long long)elapsed);
+		return false;
+	}
+	return true;
+}
+
+// Coalescing keeps the latest event per full 64-bit key in the place of
+// the first one, addresses equal in their low 32 bits stay apart.
+static bool test_coalesce_wide_keys(void) {
+	const uint64_t kFirst = 0x000011112222ULL;
+	const uint64_t kSecond = 0x000111112222ULL;
+	EventBus bus;
+	GatedListener listener;
+	bus.addListener<AddressEvent>(&listener);
+	bus.setQueuePolicy<AddressEvent>(0, EventBus::DROP_OLDEST, true,
+		[](AddressEvent& event) { return event.getAddress(); });
+
+	bus.publish<AddressEvent>(0, 0);
+	listener.waitEntered();
+	bus.publish<AddressEvent>(kFirst, 1);
+	bus.publish<AddressEvent>(kSecond, 2);
+	bus.publish<AddressEvent>(kFirst, 3);
+	bus.publish<AddressEvent>(kSecond, 4);
+	bus.publish<AddressEvent>(kFirst, 5);
+	event_queue_stats_t stats = bus.getQueueStats<AddressEvent>();
+	listener.open();
+
+	std::vector<int> seqs;
+	for (int i = 0; i < 1000 && seqs.size() < 3; i++) {
+		usleep(1000);
+		seqs = listener.getSeqs();
+	}
+	if (seqs.size() != 3 || seqs[0] != 0 || seqs[1] != 5 || seqs[2] != 4 ||
+		stats.coalesced != 3) {
+		printf("%s: delivered %zu events, coalesced %zu\n", __func__, seqs.size(),
+			stats.coalesced);
+		return false;
+	}
+	return true;
+}
+
+int main(void) {
+	bool success = true;
+
+	success &= test_parallel_listeners_overlap();
+	success &= test_coalesce_wide_keys();
+
+	printf("%s\n", success ? "PASS" : "FAIL");
+	return success ? 0 : 1;
+}
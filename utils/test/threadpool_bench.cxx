@@ -0,0 +1,122 @@
+/*********************************************************************************
+   Bluegenius - Bluetooth host protocol stack for Linux/android/windows...
+   Copyright (C) 
+   Written 2017 by hugo（yongguang hong） <hugo.08@163.com>
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License version 2 as
+   published by the Free Software Foundation;
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+   OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT OF THIRD PARTY RIGHTS.
+   IN NO EVENT SHALL THE COPYRIGHT HOLDER(S) AND AUTHOR(S) BE LIABLE FOR ANY
+   CLAIM, OR ANY SPECIAL INDIRECT OR CONSEQUENTIAL DAMAGES, OR ANY DAMAGES
+   WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+   ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+   OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+   ALL LIABILITY, INCLUDING LIABILITY FOR INFRINGEMENT OF ANY PATENTS,
+   COPYRIGHTS, TRADEMARKS OR OTHER RIGHTS, RELATING TO USE OF THIS
+   SOFTWARE IS DISCLAIMED.
+*********************************************************************************/
+/*
+ * Scaling benchmark for ThreadPool::parallel_for() and TaskGraph, from one
+ * worker up to one per online CPU (or the count given as argument). Build
+ * it from utils/ with:
+ *   g++ -std=c++17 -O2 -Iinc -include string.h test/threadpool_bench.cxx src/threadpool.cxx \
+ *     src/concurrency.cxx src/placement.cxx -lpthread -lrt
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+#include "utils.h"
+#include "concurrency.h"
+#include "threadpool.h"
+
+#define BENCH_ITEMS		(1 << 20)
+#define BENCH_ROUNDS	5
+#define GRAPH_WIDTH		64	//independent nodes between the source and the sink
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Some CPU bound work per item, the result keeps it from being optimized out.
+static uint64_t work(size_t index) {
+	uint64_t x = index + 1;
+	for (int i = 0; i < 64; i++)
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	return x;
+}
+
+static uint64_t bench_parallel_for(ThreadPool *pool, std::atomic<uint64_t> *sink) {
+	uint64_t start = now_us();
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		pool->parallel_for(0, BENCH_ITEMS, [sink](size_t begin, size_t end) {
+			uint64_t sum = 0;
+			for (size_t i = begin; i < end; i++)
+				sum += work(i);
+			sink->fetch_add(sum, std::memory_order_relaxed);
+		});
+	}
+	return (now_us() - start) / BENCH_ROUNDS;
+}
+
+// A source, GRAPH_WIDTH nodes that each take a slice of the items, and a sink.
+static uint64_t bench_task_graph(ThreadPool *pool, std::atomic<uint64_t> *sink) {
+	TaskGraph graph(pool);
+	TaskGraph::node_t source = graph.add([] {});
+	TaskGraph::node_t last = graph.add([] {});
+	for (size_t n = 0; n < GRAPH_WIDTH; n++) {
+		size_t begin = n * (BENCH_ITEMS / GRAPH_WIDTH);
+		size_t end = begin + BENCH_ITEMS / GRAPH_WIDTH;
+		TaskGraph::node_t node = graph.add([sink, begin, end] {
+			uint64_t sum = 0;
+			for (size_t i = begin; i < end; i++)
+				sum += work(i);
+			sink->fetch_add(sum, std::memory_order_relaxed);
+		});
+		graph.precede(source, node);
+		graph.precede(node, last);
+	}
+
+	uint64_t start = now_us();
+	for (int round = 0; round < BENCH_ROUNDS; round++)
+		graph.run();
+	return (now_us() - start) / BENCH_ROUNDS;
+}
+
+int main(int argc, char *argv[]) {
+	long cpus = argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) cpus = 1;
+	std::atomic<uint64_t> sink(0);
+
+	printf("%d items per run, %d runs, %ld CPUs\n", BENCH_ITEMS, BENCH_ROUNDS, cpus);
+	printf("%8s %16s %8s %16s %8s\n", "workers", "parallel_for us", "speedup",
+		"task graph us", "speedup");
+
+	uint64_t base_for = 0;
+	uint64_t base_graph = 0;
+	for (int workers = 1; workers <= cpus; workers++) {
+		ThreadPool pool(workers, workers);
+		bench_parallel_for(&pool, &sink);	//warm up
+
+		uint64_t for_us = bench_parallel_for(&pool, &sink);
+		uint64_t graph_us = bench_task_graph(&pool, &sink);
+		if (workers == 1) {
+			base_for = for_us;
+			base_graph = graph_us;
+		}
+		printf("%8d %16llu %8.2f %16llu %8.2f\n", workers,
+			(unsigned long long)for_us, (double)base_for / for_us,
+			(unsigned long long)graph_us, (double)base_graph / graph_us);
+	}
+
+	return sink.load() == 0;
+}